@@ -3,8 +3,14 @@
 #include "allocator.h"
 
 #include <libxo/xo.h>
+#include <sys/param.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <sysexits.h>
+#include <unistd.h>
 
 #if __STDC_VERSION__ >= 202311L
 static_assert(true); // Workaround for https://github.com/clangd/clangd/issues/1167
@@ -33,29 +39,93 @@ static_assert(true); // Workaround for https://github.com/clangd/clangd/issues/1
 #pragma clang diagnostic ignored "-Wgnu-designator"
 #endif
 
+// The summary is an implicit binary tree (heap order, root at index 1) over the
+// 64 bit words of the bitstring. Each node stores its order (log2 of the bits
+// it covers) minus the order of the largest aligned free block inside it.
+// A fully free node stores zero which lets calloc() initialise the tree and a
+// fully used node stores its order plus one. This makes finding an aligned
+// free block of any size a single walk from the root to a node.
+#define WORD_BITS  64
+#define WORD_ORDER 6
+
+_Static_assert(sizeof(bitstr_t) == sizeof(uint64_t), "The summary assumes 64 bit bitstring words.");
+
+// Return a mask of the aligned free blocks of 2^order bits (order <= 6) in a word.
 static inline uint64_t
-addr_to_u64(const struct ether_addr addr)
-{
-	return  ((uint64_t)(addr.octet[0])) << 5*8 |
-		((uint64_t)(addr.octet[1])) << 4*8 |
-		((uint64_t)(addr.octet[2])) << 3*8 |
-		((uint64_t)(addr.octet[3])) << 2*8 |
-		((uint64_t)(addr.octet[4])) << 1*8 |
-		((uint64_t)(addr.octet[5]));
-}
-
-static inline struct ether_addr
-u64_to_addr(const uint64_t u64) {
-	return (struct ether_addr) {
-		.octet = {
-			[0] = (uint8_t)(u64 >> 5*8),
-			[1] = (uint8_t)(u64 >> 4*8),
-			[2] = (uint8_t)(u64 >> 3*8),
-			[3] = (uint8_t)(u64 >> 2*8),
-			[4] = (uint8_t)(u64 >> 1*8),
-			[5] = (uint8_t)(u64 >> 0*8)
-		}
+word_free_blocks(const uint64_t word, const unsigned order)
+{
+	static const uint64_t even[WORD_ORDER] = {
+		0x5555555555555555, 0x1111111111111111, 0x0101010101010101,
+		0x0001000100010001, 0x0000000100000001, 0x0000000000000001
 	};
+	uint64_t free = ~word;
+	for (unsigned i = 0; i < order; i++) {
+		free &= (free >> (1u << i)) & even[i];
+	}
+	return free;
+}
+
+static inline uint8_t
+leaf_deficit(const uint64_t word)
+{
+	uint8_t deficit = 0;
+	while (deficit <= WORD_ORDER && word_free_blocks(word, WORD_ORDER - deficit) == 0) {
+		deficit++;
+	}
+	return deficit;
+}
+
+static inline uint8_t
+node_deficit(const uint8_t left, const uint8_t right)
+{
+	if ((left | right) == 0) {
+		return 0;
+	} else {
+		return (uint8_t)(1 + (left < right ? left : right));
+	}
+}
+
+// Recompute the summary leaves of the words [first, last].
+static void
+summary_leaves(const struct allocator allocator, const uint64_t first, const uint64_t last)
+{
+	const uint64_t words = (allocator.size + WORD_BITS - 1) / WORD_BITS;
+	uint8_t *_Nonnull const summary = allocator.summary;
+
+	for (uint64_t word = first; word <= last; word++) {
+		const uint8_t deficit = word < words ? leaf_deficit(allocator.bitstring[word]) : WORD_ORDER + 1;
+		summary[allocator.leaves + word] = deficit;
+	}
+}
+
+// Recompute the ancestors of the summary nodes [first, last] up to the given number of levels.
+// Stops early once a level is unchanged.
+static void
+summary_nodes(const struct allocator allocator, uint64_t first, uint64_t last, unsigned levels)
+{
+	uint8_t *_Nonnull const summary = allocator.summary;
+
+	for (; first > 1 && levels > 0; levels--) {
+		first /= 2;
+		last  /= 2;
+		bool changed = false;
+		for (uint64_t node = first; node <= last; node++) {
+			const uint8_t deficit = node_deficit(summary[2 * node], summary[2 * node + 1]);
+			changed |= summary[node] != deficit;
+			summary[node] = deficit;
+		}
+		if (!changed) {
+			break;
+		}
+	}
+}
+
+// Recompute the summary for the words [first, last] and their ancestors.
+static void
+summary_update(const struct allocator allocator, const uint64_t first, const uint64_t last)
+{
+	summary_leaves(allocator, first, last);
+	summary_nodes(allocator, allocator.leaves + first, allocator.leaves + last, UINT_MAX);
 }
 
 struct allocator
@@ -70,16 +140,41 @@ allocator_create(const struct ether_addr min, const struct ether_addr max)
 	if (bitstring == NULL) {
 		xo_err(EX_OSERR, "Failed to allocate %lu bit bitstring.", size);
 	}
-	return (struct allocator) {
+
+	const uint64_t words  = (size + WORD_BITS - 1) / WORD_BITS;
+	uint64_t       leaves = 1;
+	while (leaves < words) {
+		leaves *= 2;
+	}
+	uint8_t *_Nullable const summary = calloc((size_t)(2 * leaves), sizeof(uint8_t));
+	if (summary == NULL) {
+		xo_err(EX_OSERR, "Failed to allocate %lu byte bitstring summary.", 2 * leaves);
+	}
+
+	const struct allocator allocator = {
 		.bitstring = bitstring,
+		.summary   = summary,
 		.offset    = offset,
-		.size      = size
+		.size      = size,
+		.leaves    = leaves
 	};
+
+	// Mark the padding after the last address as used.
+	if (size % WORD_BITS != 0) {
+		bitstring[size / WORD_BITS] |= ~UINT64_C(0) << (size % WORD_BITS);
+		summary_update(allocator, size / WORD_BITS, size / WORD_BITS);
+	}
+	if (words < leaves) {
+		summary_update(allocator, words, leaves - 1);
+	}
+
+	return allocator;
 }
 
 void
 allocator_destroy(struct allocator allocator)
 {
+	free(allocator.summary);
 	free(allocator.bitstring);
 }
 
@@ -92,24 +187,319 @@ allocator_cleanup(struct allocator allocator[static const 1])
 void
 allocator_claim(const struct allocator allocator, const struct ether_addr addr[const static 1]) {
 	uint64_t position = addr_to_u64(*addr) - allocator.offset;
-	if (position < allocator.size) {
+	if (position < allocator.size && !bit_test(allocator.bitstring, position)) {
 		bit_set(allocator.bitstring, position);
+		summary_update(allocator, position / WORD_BITS, position / WORD_BITS);
+	}
+}
+
+// Bulk loads are split between threads at the boundaries of summary subtrees
+// of 2^ALLOCATOR_SUBTREE_LEVELS words so every thread owns the bitstring words and
+// summary nodes below its subtrees. Only the nodes above them are left to update after joining.
+#define ALLOCATOR_SUBTREE_LEVELS 10
+#define ALLOCATOR_THREADS        16
+#define ALLOCATOR_THREAD_CLAIMS  65536
+
+struct claim_range {
+	const struct allocator *_Nonnull allocator;
+	const uint64_t         *_Nonnull sorted;
+	size_t                           count;
+	uint64_t                         first;
+	uint64_t                         last;
+	pthread_t                        thread;
+};
+
+// Merge the bits a word at a time and update the summary once per run of consecutive words
+// up to the roots of the subtrees touched. Records the touched words in [first, last].
+static void *_Nullable
+claim_range(void *_Nonnull const argument)
+{
+	struct claim_range *_Nonnull const range     = argument;
+	const struct allocator             allocator = *range->allocator;
+	const uint64_t *_Nonnull const     sorted    = range->sorted;
+	const size_t                       count     = range->count;
+	uint64_t                           first     = UINT64_MAX;
+	uint64_t                           last      = UINT64_MAX;
+
+	range->first = UINT64_MAX;
+	for (size_t index = 0; index < count;) {
+		const uint64_t position = sorted[index] - allocator.offset;
+		if (position >= allocator.size) {
+			index++;
+			continue;
+		}
+
+		const uint64_t word = position / WORD_BITS;
+		uint64_t       mask = 0;
+		for (; index < count; index++) {
+			const uint64_t next = sorted[index] - allocator.offset;
+			if (next >= allocator.size || next / WORD_BITS != word) {
+				break;
+			}
+			mask |= UINT64_C(1) << (next % WORD_BITS);
+		}
+		allocator.bitstring[word] |= mask;
+
+		if (first != UINT64_MAX && word == last + 1) {
+			last = word;
+			continue;
+		} else if (first != UINT64_MAX) {
+			summary_leaves(allocator, first, last);
+			summary_nodes(allocator, allocator.leaves + first, allocator.leaves + last, ALLOCATOR_SUBTREE_LEVELS);
+		}
+		range->first = MIN(range->first, word);
+		first = last = word;
 	}
+	if (first != UINT64_MAX) {
+		summary_leaves(allocator, first, last);
+		summary_nodes(allocator, allocator.leaves + first, allocator.leaves + last, ALLOCATOR_SUBTREE_LEVELS);
+	}
+	range->last = last;
+	return NULL;
+}
+
+// Return the index of the first address at or after the start of the next subtree.
+// Addresses outside the range are skipped by every thread and can be split anywhere.
+static size_t
+subtree_end(const struct allocator allocator, const uint64_t sorted[const], const size_t count, size_t index)
+{
+	const uint64_t span     = (uint64_t)WORD_BITS << ALLOCATOR_SUBTREE_LEVELS;
+	const uint64_t position = sorted[index] - allocator.offset;
+	if (position >= allocator.size) {
+		return index;
+	}
+	const uint64_t next = allocator.offset + (position / span + 1) * span;
+	size_t         end  = count;
+	while (index < end) {
+		const size_t middle = index + (end - index) / 2;
+		if (sorted[middle] < next) {
+			index = middle + 1;
+		} else {
+			end = middle;
+		}
+	}
+	return index;
 }
 
+// Claim an ascending array of packed addresses at once.
+// Large arrays are split into ranges of whole summary subtrees claimed by concurrent threads
+// without atomics before the summary above the subtrees is updated.
+void
+allocator_claim_sorted(const struct allocator allocator, const uint64_t sorted[const], const size_t count)
+{
+	const long     online  = sysconf(_SC_NPROCESSORS_ONLN);
+	const size_t   threads = MAX(MIN(MIN((size_t)MAX(online, 1), ALLOCATOR_THREADS), count / ALLOCATOR_THREAD_CLAIMS), 1);
+	struct claim_range ranges[ALLOCATOR_THREADS];
+
+	size_t begin = 0;
+	for (size_t i = 0; i < threads; i++) {
+		const size_t end = i + 1 == threads ? count : MAX(begin, subtree_end(allocator, sorted, count, count / threads * (i + 1)));
+		ranges[i] = (struct claim_range) {
+			.allocator = &allocator,
+			.sorted    = &sorted[begin],
+			.count     = end - begin,
+			.first     = UINT64_MAX,
+			.last      = UINT64_MAX
+		};
+		begin = end;
+	}
+
+	for (size_t i = 1; i < threads; i++) {
+		const int error = pthread_create(&ranges[i].thread, NULL, claim_range, &ranges[i]);
+		if (error != 0) {
+			errno = error;
+			xo_err(EX_OSERR, "Failed to create allocator thread");
+		}
+	}
+	claim_range(&ranges[0]);
+	for (size_t i = 1; i < threads; i++) {
+		const int error = pthread_join(ranges[i].thread, NULL);
+		if (error != 0) {
+			errno = error;
+			xo_err(EX_OSERR, "Failed to join allocator thread");
+		}
+	}
+
+	for (size_t i = 0; i < threads; i++) {
+		if (ranges[i].first != UINT64_MAX) {
+			const uint64_t first = (allocator.leaves + ranges[i].first) >> ALLOCATOR_SUBTREE_LEVELS;
+			const uint64_t last  = (allocator.leaves + ranges[i].last ) >> ALLOCATOR_SUBTREE_LEVELS;
+			summary_nodes(allocator, first, last, UINT_MAX);
+		}
+	}
+}
+
+void
+allocator_release(const struct allocator allocator, const struct ether_addr addr[const static 1]) {
+	uint64_t position = addr_to_u64(*addr) - allocator.offset;
+	if (position < allocator.size && bit_test(allocator.bitstring, position)) {
+		bit_clear(allocator.bitstring, position);
+		summary_update(allocator, position / WORD_BITS, position / WORD_BITS);
+	}
+}
+
+// Claim the addresses [first, first + count) inside the allocator's range.
+void
+allocator_claim_range(const struct allocator allocator, const struct ether_addr first[const static 1], const uint64_t count)
+{
+	const uint64_t start = addr_to_u64(*first) - allocator.offset;
+	if (start >= allocator.size || count == 0) {
+		return;
+	}
+	const uint64_t stop = MIN(start + count, allocator.size);
+	bit_nset(allocator.bitstring, (size_t)start, (size_t)(stop - 1));
+	summary_update(allocator, start / WORD_BITS, (stop - 1) / WORD_BITS);
+}
+
+// Release the addresses [first, first + count) inside the allocator's range.
+void
+allocator_release_range(const struct allocator allocator, const struct ether_addr first[const static 1], const uint64_t count)
+{
+	const uint64_t start = addr_to_u64(*first) - allocator.offset;
+	if (start >= allocator.size || count == 0) {
+		return;
+	}
+	const uint64_t stop = MIN(start + count, allocator.size);
+	bit_nclear(allocator.bitstring, (size_t)start, (size_t)(stop - 1));
+	summary_update(allocator, start / WORD_BITS, (stop - 1) / WORD_BITS);
+}
+
+// Allocate the lowest free address in [first, first + count).
 bool
-allocator_alloc(const struct allocator allocator, struct ether_addr addr[const static 1])
+allocator_alloc_range(const struct allocator allocator, const struct ether_addr first[const static 1], const uint64_t count,
+                      struct ether_addr addr[const static 1])
 {
-	ssize_t first = -1;
-	bit_ffc(allocator.bitstring, allocator.size, &first);
-	if (first < 0) {
+	const uint64_t start = addr_to_u64(*first) - allocator.offset;
+	if (start >= allocator.size || count == 0) {
 		return false;
-	} else {
-		const size_t bit = (size_t)first;
-		bit_set(allocator.bitstring, bit);
-		*addr = u64_to_addr(bit + allocator.offset);
+	}
+	const uint64_t stop = MIN(start + count, allocator.size);
+	for (uint64_t position = start; position < stop;) {
+		const uint64_t word = position / WORD_BITS;
+		const uint64_t free = ~allocator.bitstring[word] & (UINT64_MAX << (position % WORD_BITS));
+		if (free == 0) {
+			position = (word + 1) * WORD_BITS;
+			continue;
+		}
+		const uint64_t found = word * WORD_BITS + (uint64_t)__builtin_ctzll(free);
+		if (found >= stop) {
+			return false;
+		}
+		bit_set(allocator.bitstring, found);
+		summary_update(allocator, word, word);
+		*addr = u64_to_addr(allocator.offset + found);
 		return true;
 	}
+	return false;
+}
+
+// Allocate 2^order consecutive addresses aligned (relative to the minimum address) to their size.
+// Walks from the root of the summary towards the left most node with a large enough free block.
+bool
+allocator_alloc_block(const struct allocator allocator, const unsigned order, struct ether_addr addr[const static 1])
+{
+	const uint8_t *_Nonnull const summary = allocator.summary;
+	unsigned height = 0;
+	while ((UINT64_C(1) << height) < allocator.leaves) {
+		height++;
+	}
+
+	if (order > height + WORD_ORDER || summary[1] > height + WORD_ORDER - order) {
+		return false;
+	}
+
+	uint64_t node = 1;
+	while (height > 0 && height + WORD_ORDER > order) {
+		height--;
+		node *= 2;
+		if (summary[node] > height + WORD_ORDER - order) {
+			node++;
+		}
+	}
+
+	const uint64_t word  = (node << height) - allocator.leaves;
+	const uint64_t count = UINT64_C(1) << order;
+	uint64_t       first = word * WORD_BITS;
+	if (order < WORD_ORDER) {
+		const uint64_t blocks = word_free_blocks(allocator.bitstring[word], order);
+		first += (uint64_t)__builtin_ctzll(blocks);
+	}
+
+	bit_nset(allocator.bitstring, (size_t)first, (size_t)(first + count - 1));
+	summary_update(allocator, first / WORD_BITS, (first + count - 1) / WORD_BITS);
+	*addr = u64_to_addr(first + allocator.offset);
+	return true;
+}
+
+static void
+usage_end_run(struct allocator_usage usage[const static 1], uint64_t run[const static 1])
+{
+	if (*run != 0) {
+		usage->runs[63 - __builtin_clzll(*run)]++;
+		if (*run > usage->largest_run) {
+			usage->largest_run = *run;
+		}
+		*run = 0;
+	}
+}
+
+static void
+usage_word(struct allocator_usage usage[const static 1], uint64_t run[const static 1], const uint64_t word)
+{
+	usage->free += (uint64_t)(WORD_BITS - __builtin_popcountll(word));
+	for (unsigned position = 0; position < WORD_BITS;) {
+		const uint64_t rest = word >> position;
+		if (rest == 0) {
+			*run += WORD_BITS - position;
+			break;
+		}
+		const unsigned zeros = (unsigned)__builtin_ctzll(rest);
+		*run     += zeros;
+		position += zeros;
+		usage_end_run(usage, run);
+		position += (unsigned)__builtin_ctzll(~(word >> position));
+	}
+}
+
+// Walk the summary in address order only descending into partially used nodes.
+static void
+usage_node(const struct allocator allocator, struct allocator_usage usage[const static 1], uint64_t run[const static 1], const uint64_t node, const unsigned height)
+{
+	const uint8_t  deficit = allocator.summary[node];
+	const uint64_t bits    = (uint64_t)WORD_BITS << height;
+	if (deficit == 0) {
+		usage->free += bits;
+		*run        += bits;
+	} else if (deficit == height + WORD_ORDER + 1) {
+		usage_end_run(usage, run);
+	} else if (height == 0) {
+		usage_word(usage, run, allocator.bitstring[node - allocator.leaves]);
+	} else {
+		usage_node(allocator, usage, run, 2 * node    , height - 1);
+		usage_node(allocator, usage, run, 2 * node + 1, height - 1);
+	}
+}
+
+struct allocator_usage
+allocator_usage(const struct allocator allocator)
+{
+	struct allocator_usage usage = { .used = 0, .free = 0, .largest_run = 0, .runs = { 0 } };
+	uint64_t               run   = 0;
+	unsigned               height = 0;
+	while ((UINT64_C(1) << height) < allocator.leaves) {
+		height++;
+	}
+
+	usage_node(allocator, &usage, &run, 1, height);
+	usage_end_run(&usage, &run);
+	usage.used = allocator.size - usage.free;
+	return usage;
+}
+
+bool
+allocator_alloc(const struct allocator allocator, struct ether_addr addr[const static 1])
+{
+	return allocator_alloc_block(allocator, 0, addr);
 }
 
 #pragma clang diagnostic pop
@@ -6,6 +6,7 @@
 #include <net/ethernet.h>
 #include <bitstring.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #if __STDC_VERSION__ >= 202311L
 static_assert(true); // Workaround for https://github.com/clangd/clangd/issues/1167
@@ -34,17 +35,63 @@ static_assert(true); // Workaround for https://github.com/clangd/clangd/issues/1
 #pragma clang diagnostic ignored "-Wgnu-designator"
 #endif
 
+static inline uint64_t
+addr_to_u64(const struct ether_addr addr)
+{
+	return  ((uint64_t)(addr.octet[0])) << 5*8 |
+		((uint64_t)(addr.octet[1])) << 4*8 |
+		((uint64_t)(addr.octet[2])) << 3*8 |
+		((uint64_t)(addr.octet[3])) << 2*8 |
+		((uint64_t)(addr.octet[4])) << 1*8 |
+		((uint64_t)(addr.octet[5]));
+}
+
+static inline struct ether_addr
+u64_to_addr(const uint64_t u64) {
+	return (struct ether_addr) {
+		.octet = {
+			[0] = (uint8_t)(u64 >> 5*8),
+			[1] = (uint8_t)(u64 >> 4*8),
+			[2] = (uint8_t)(u64 >> 3*8),
+			[3] = (uint8_t)(u64 >> 2*8),
+			[4] = (uint8_t)(u64 >> 1*8),
+			[5] = (uint8_t)(u64 >> 0*8)
+		}
+	};
+}
+
 struct allocator {
 	bitstr_t *_Nonnull const bitstring;
+	uint8_t  *_Nonnull const summary;
 	const uint64_t           offset;
 	const uint64_t           size;
+	const uint64_t           leaves;
+};
+
+// Free runs are counted in power of two buckets: runs[i] counts runs of [2^i, 2^(i+1)) addresses.
+#define ALLOCATOR_RUN_BUCKETS 48
+
+struct allocator_usage {
+	uint64_t used;
+	uint64_t free;
+	uint64_t largest_run;
+	uint64_t runs[ALLOCATOR_RUN_BUCKETS];
 };
 
 struct allocator allocator_create(const struct ether_addr min, const struct ether_addr max);
 void             allocator_destroy(struct allocator allocator);
 void             allocator_cleanup(struct allocator allocator[static const 1]);
 void             allocator_claim(struct allocator allocator, const struct ether_addr addr[const static 1]);
+void             allocator_claim_sorted(struct allocator allocator, const uint64_t sorted[const], size_t count);
+void             allocator_claim_range(struct allocator allocator, const struct ether_addr first[const static 1], uint64_t count);
+void             allocator_release(struct allocator allocator, const struct ether_addr addr[const static 1]);
+void             allocator_release_range(struct allocator allocator, const struct ether_addr first[const static 1], uint64_t count);
 bool             allocator_alloc(struct allocator allocator, struct ether_addr addr[const static 1]);
+bool             allocator_alloc_range(struct allocator allocator, const struct ether_addr first[const static 1], uint64_t count,
+                                       struct ether_addr addr[const static 1]);
+bool             allocator_alloc_block(struct allocator allocator, unsigned order, struct ether_addr addr[const static 1]);
+
+struct allocator_usage allocator_usage(struct allocator allocator);
 
 #pragma clang diagnostic pop
 
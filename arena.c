@@ -0,0 +1,129 @@
+// vim: ft=c:ts=8 :
+
+#include "arena.h"
+
+// Include library headers
+#include <libxo/xo.h>
+
+// Include system headers from subdirectories.
+#include <sys/param.h>
+
+// Include system headers
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+#if __STDC_VERSION__ >= 202311L
+static_assert(true); // Workaround for https://github.com/clangd/clangd/issues/1167
+#endif 
+
+#pragma clang diagnostic push
+
+// Set *very* aggressive diagnostics specific to clang (version 19.1.3).
+// These diagnostics aren't stable between compiler versions.
+// If used like this they're **EXPECTED** to break break the build,
+// but they're also useful for catching errors.
+// Use `make debug` to build with these diagnostics.
+#ifdef RACONIC
+#pragma clang diagnostic error   "-Weverything"
+#pragma clang diagnostic ignored "-Wunsafe-buffer-usage"
+#pragma clang diagnostic ignored "-Wdeclaration-after-statement"
+#pragma clang diagnostic ignored "-Wpre-c11-compat"
+#pragma clang diagnostic ignored "-Wpre-c23-compat"
+#pragma clang diagnostic ignored "-Wc2y-extensions"
+#pragma clang diagnostic ignored "-Wc++98-compat"
+#pragma clang diagnostic ignored "-Wnullability-extension"
+#pragma clang diagnostic ignored "-Wvla"
+#pragma clang diagnostic ignored "-Wgnu-statement-expression"
+#pragma clang diagnostic ignored "-Wgnu-conditional-omitted-operand"
+#pragma clang diagnostic ignored "-Wgnu-case-range"
+#pragma clang diagnostic ignored "-Wgnu-designator"
+#endif
+
+struct arena_chunk {
+	struct arena_chunk *_Nullable next;
+	size_t                        size;
+	size_t                        used;
+	alignas(CACHE_LINE_SIZE) char data[];
+};
+
+// Align each allocation to the largest power of two dividing the element size
+// (the alignment of any type of that size) up to a cache line
+// to keep over-aligned types (e.g. the pipeline rings) aligned.
+static size_t
+arena_align(const size_t size)
+{
+	const size_t align = size & -size;
+	return align == 0 || align > CACHE_LINE_SIZE ? CACHE_LINE_SIZE : align;
+}
+
+void *_Nonnull
+arena_alloc(struct arena arena[const static 1], const size_t count, const size_t size)
+{
+	if (size != 0 && count > SIZE_MAX / 2 / size) {
+		xo_errx(EX_SOFTWARE, "Arena allocation of %zu elements of %zu bytes overflows.", count, size);
+	}
+	const size_t                  bytes = count * size;
+	const size_t                  align = arena_align(size);
+	struct arena_chunk *_Nullable chunk = arena->chunk;
+	size_t                        used  = chunk == NULL ? 0 : (chunk->used + align - 1) & ~(align - 1);
+
+	if (chunk == NULL || chunk->size - MIN(used, chunk->size) < bytes) {
+		const size_t capacity = roundup2(MAX(bytes, ARENA_CHUNK - sizeof(struct arena_chunk)), CACHE_LINE_SIZE);
+		chunk = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct arena_chunk) + capacity);
+		if (chunk == NULL) {
+			xo_err(EX_OSERR, "Failed to allocate %zu byte arena chunk", capacity);
+		}
+		chunk->next  = arena->chunk;
+		chunk->size  = capacity;
+		chunk->used  = 0;
+		arena->chunk = chunk;
+		used         = 0;
+	}
+
+	void *_Nonnull const result = &chunk->data[used];
+	chunk->used = used + bytes;
+	arena->last = result;
+	return result;
+}
+
+// Grow an array from count to capacity elements.
+// The array is extended in place if it's the most recent allocation and still fits,
+// otherwise the elements are copied to a new allocation.
+void *_Nonnull
+arena_grow(struct arena arena[const static 1], void *_Nullable const array, const size_t count, const size_t capacity, const size_t size)
+{
+	struct arena_chunk *_Nullable const chunk = arena->chunk;
+	if (array != NULL && array == arena->last && capacity <= SIZE_MAX / 2 / size) {
+		const size_t offset = (size_t)((char *)array - chunk->data);
+		if (chunk->size - offset >= capacity * size) {
+			chunk->used = offset + capacity * size;
+			return array;
+		}
+	}
+	void *_Nonnull const grown = arena_alloc(arena, capacity, size);
+	if (array != NULL && count != 0) {
+		memcpy(grown, array, count * size);
+	}
+	return grown;
+}
+
+void
+arena_destroy(struct arena arena)
+{
+	for (struct arena_chunk *_Nullable chunk = arena.chunk, *_Nullable next; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+}
+
+void
+arena_cleanup(struct arena arena[static const 1])
+{
+	arena_destroy(*arena);
+	*arena = ARENA_INIT;
+}
+
+#pragma clang diagnostic pop
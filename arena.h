@@ -0,0 +1,53 @@
+// vim: ft=c:ts=8 :
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#if __STDC_VERSION__ >= 202311L
+static_assert(true); // Workaround for https://github.com/clangd/clangd/issues/1167
+#endif 
+
+#pragma clang diagnostic push
+
+// Set *very* aggressive diagnostics specific to clang (version 19.1.3).
+// These diagnostics aren't stable between compiler versions.
+// If used like this they're **EXPECTED** to break break the build,
+// but they're also useful for catching errors.
+// Use `make debug` to build with these diagnostics.
+#ifdef RACONIC
+#pragma clang diagnostic error   "-Weverything"
+#pragma clang diagnostic ignored "-Wunsafe-buffer-usage"
+#pragma clang diagnostic ignored "-Wdeclaration-after-statement"
+#pragma clang diagnostic ignored "-Wpre-c11-compat"
+#pragma clang diagnostic ignored "-Wpre-c23-compat"
+#pragma clang diagnostic ignored "-Wc2y-extensions"
+#pragma clang diagnostic ignored "-Wc++98-compat"
+#pragma clang diagnostic ignored "-Wnullability-extension"
+#pragma clang diagnostic ignored "-Wvla"
+#pragma clang diagnostic ignored "-Wgnu-statement-expression"
+#pragma clang diagnostic ignored "-Wgnu-conditional-omitted-operand"
+#pragma clang diagnostic ignored "-Wgnu-case-range"
+#pragma clang diagnostic ignored "-Wgnu-designator"
+#endif
+
+// Allocations are carved out of chunks of at least this size.
+#define ARENA_CHUNK ((size_t)1 << 20)
+
+// A bump allocator for the storage of a single run freed all at once.
+// The most recent allocation can grow in place while its chunk has room left.
+struct arena {
+	struct arena_chunk *_Nullable chunk;
+	void               *_Nullable last;
+};
+
+#define ARENA_INIT ((struct arena) { .chunk = NULL, .last = NULL })
+
+void *_Nonnull arena_alloc(struct arena arena[const static 1], size_t count, size_t size);
+void *_Nonnull arena_grow(struct arena arena[const static 1], void *_Nullable array, size_t count, size_t capacity, size_t size);
+void           arena_destroy(struct arena arena);
+void           arena_cleanup(struct arena arena[static const 1]);
+
+#pragma clang diagnostic pop
+#endif /* ARENA_H */
@@ -2,12 +2,17 @@
 
 
 #include <libxo/xo.h>
+#include <sys/param.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdint.h>
 #include <string.h>
 #include <sysexits.h>
 #include <unistd.h>
 
 #include "scan.h"
 #include "cli_args.h"
+#include "lease.h"
 
 #if __STDC_VERSION__ >= 202311L
 static_assert(true); // Workaround for https://github.com/clangd/clangd/issues/1167
@@ -39,16 +44,31 @@ static_assert(true); // Workaround for https://github.com/clangd/clangd/issues/1
 // Define string constants as macros (constexpr is a C23 feature).
 #define PROG_NAME   "ethers"
 #define ETHERS_PATH "/etc/ethers"
+#define SHARD_NAME  "local"
+
+// Long options without a short option letter return values outside of the character range.
+#define OPTION_EXPORT_BIN (CHAR_MAX + 1)
 
 static const char usage_message[] =
 	"usage: " PROG_NAME
 	" [-h]"          /* -h         : help                   */
 	" [-q]"          /* -q         : quiet                  */
 	" [-v]"          /* -v         : verbose                */
+	" [-u]"          /* -u         : report pool usage      */
+	" [-l]"          /* -l         : lookup only            */
+	" [-g]"          /* -g         : query glob patterns    */
+	" [-D]"          /* -D         : release the names      */
+	" [-S]"          /* -S         : shared allocator       */
+	" [-c[<key>]]"   /* -c [<key>] : compact sorted by key  */
+	" [-F]"          /* -F         : follow appended lines  */
 	" [-f <ethers>]" /* -f <ether> : path to ethers(5) file */
+	" [-s <shard>]"  /* -s <shard> : shard for new mappings */
 	" [-m <min>]"    /* -m <min>   : minimum allowed MAC    */
 	" [-M <max>]"    /* -M <max>   : maximum allowed MAC    */
-	" [<name> ...]";
+	" [-o <owner>]"  /* -o <owner> : owner of leases        */
+	" [-L <count>[:<seconds>]]" /* -L <count>[:<seconds>] : lease size and duration */
+	" [--export-bin <out>]" /* --export-bin <out> : write a binary snapshot */
+	" [<name>[/<count>] | <pattern> ...]";
 
 static inline const char *_Nonnull
 bool_to_string(const bool boolean)
@@ -90,6 +110,21 @@ emit_label(const char label[const static 1]) {
 	}
 }
 
+static inline void
+emit_compact(const struct cli_args args[const static 1]) {
+	const char *_Nonnull const compact = !args->compact ? "false" : args->compact_by_name ? "name" : "address";
+	if (xo_emit("{P:\t}{Lwc:Compact}{P:    }{D: = }{:compact}\n", compact) < 0) {
+		xo_err(EX_IOERR, "Failed to emit compact argument");
+	}
+}
+
+static inline void
+emit_follow(const struct cli_args args[const static 1]) {
+	if (xo_emit("{P:\t}{Lwc:Follow}{P:     }{D: = }{:follow}\n", bool_to_string(args->follow)) < 0) {
+		xo_err(EX_IOERR, "Failed to emit follow argument");
+	}
+}
+
 static inline void
 emit_help(const struct cli_args args[const static 1]) {
 	if (xo_emit("{P:\t}{Lwc:Help}{P:       }{D: = }{:help}\n"  , bool_to_string(args->help   )) < 0) {
@@ -97,6 +132,20 @@ emit_help(const struct cli_args args[const static 1]) {
 	}
 }
 
+static inline void
+emit_lookup(const struct cli_args args[const static 1]) {
+	if (xo_emit("{P:\t}{Lwc:Lookup}{P:     }{D: = }{:lookup}\n"  , bool_to_string(args->lookup )) < 0) {
+		xo_err(EX_IOERR, "Failed to emit lookup argument");
+	}
+}
+
+static inline void
+emit_query(const struct cli_args args[const static 1]) {
+	if (xo_emit("{P:\t}{Lwc:Query}{P:      }{D: = }{:query}\n"  , bool_to_string(args->query  )) < 0) {
+		xo_err(EX_IOERR, "Failed to emit query argument");
+	}
+}
+
 static inline void
 emit_quiet(const struct cli_args args[const static 1]) {
 	if (xo_emit("{P:\t}{Lwc:Quiet}{P:      }{D: = }{:quiet}\n"  , bool_to_string(args->quiet  )) < 0) {
@@ -104,6 +153,27 @@ emit_quiet(const struct cli_args args[const static 1]) {
 	}
 }
 
+static inline void
+emit_release(const struct cli_args args[const static 1]) {
+	if (xo_emit("{P:\t}{Lwc:Release}{P:    }{D: = }{:release}\n", bool_to_string(args->release)) < 0) {
+		xo_err(EX_IOERR, "Failed to emit release argument");
+	}
+}
+
+static inline void
+emit_report(const struct cli_args args[const static 1]) {
+	if (xo_emit("{P:\t}{Lwc:Report}{P:     }{D: = }{:report}\n"  , bool_to_string(args->report )) < 0) {
+		xo_err(EX_IOERR, "Failed to emit report argument");
+	}
+}
+
+static inline void
+emit_shared(const struct cli_args args[const static 1]) {
+	if (xo_emit("{P:\t}{Lwc:Shared}{P:     }{D: = }{:shared}\n"  , bool_to_string(args->shared )) < 0) {
+		xo_err(EX_IOERR, "Failed to emit shared argument");
+	}
+}
+
 static inline void
 emit_usage(const struct cli_args args[const static 1]) {
 	if (xo_emit("{P:\t}{Lwc:Usage}{P:      }{D: = }{:usage}\n"  , bool_to_string(args->usage  )) < 0) {
@@ -118,6 +188,28 @@ emit_verbose(const struct cli_args args[const static 1]) {
 	}
 }
 
+static inline void
+emit_export(const struct cli_args args[const static 1]) {
+	if (args->export_path != NULL && xo_emit("{P:\t}{Lwc:Export}{P:     }{D: = }{:export}\n", args->export_path) < 0) {
+		xo_err(EX_IOERR, "Failed to emit export argument");
+	}
+}
+
+static inline void
+emit_owner(const struct cli_args args[const static 1]) {
+	if (args->owner != NULL && xo_emit("{P:\t}{Lwc:Owner}{P:      }{D: = }{:owner}\n", args->owner) < 0) {
+		xo_err(EX_IOERR, "Failed to emit owner argument");
+	}
+}
+
+static inline void
+emit_lease(const struct cli_args args[const static 1]) {
+	if (args->lease_count != 0 && xo_emit("{P:\t}{Lwc:Lease}{P:      }{D: = }{:lease-count/%ju}{D::}{:lease-seconds/%ju}\n",
+	                                      (uintmax_t)args->lease_count, (uintmax_t)args->lease_seconds) < 0) {
+		xo_err(EX_IOERR, "Failed to emit lease argument");
+	}
+}
+
 static inline void
 emit_min_mac(const struct cli_args args[const static 1]) {
 	if (xo_emit("{P:\t}{Lwc:Minimum MAC}{P:}{D: = }{:min-mac}\n", addr_to_string(args->min_mac).addr) < 0) {
@@ -151,10 +243,20 @@ print_cli_args(const struct cli_args args[const static 1])
 
 		emit_label("CLI arguments");
 
+		emit_compact(args);
+		emit_export(args);
+		emit_follow(args);
 		emit_help(args);
+		emit_lookup(args);
+		emit_query(args);
 		emit_quiet(args);
+		emit_release(args);
+		emit_report(args);
+		emit_shared(args);
 		emit_usage(args);
 		emit_verbose(args);
+		emit_owner(args);
+		emit_lease(args);
 		emit_min_mac(args);
 		emit_max_mac(args);
 
@@ -179,28 +281,74 @@ print_help_and_exit(void)
 	exit(0);
 }
 
+// Owners are named like hostnames.
+static bool
+is_owner(const char owner[const static 1])
+{
+	struct maybe       name = none;
+	const struct valid rest = or_empty(scan_name(valid_string(owner), &name));
+	return !is_null(name) && name.start == owner && is_empty(rest) && strlen(owner) < MAXHOSTNAMELEN;
+}
+
+static bool
+parse_lease(const char lease[const static 1], uint64_t count[const static 1], uint64_t seconds[const static 1])
+{
+	const struct maybe after_count = scan_count(valid_string(lease), count);
+	if (is_null(after_count) || lease[0] < '0' || lease[0] > '9' || *count == 0 || (*count & (*count - 1)) != 0) {
+		return false;
+	}
+	const struct valid rest = or_empty(after_count);
+	if (is_empty(rest)) {
+		return true;
+	} else if (rest.start[0] != ':' || rest.start[1] < '0' || rest.start[1] > '9') {
+		return false;
+	}
+	const struct maybe after_seconds = scan_count(VALID(&rest.start[1], rest.end), seconds);
+	return !is_null(after_seconds) && is_empty(or_empty(after_seconds)) && *seconds > LEASE_MARGIN;
+}
+
 struct cli_args
 parse_cli_args(int argc, char **argv)
 {
 	// Start with the default values.
 	static const char *_Nonnull const empty_name = "";
 	static const char ethers_path[] = ETHERS_PATH;
+	static const char shard[]       = SHARD_NAME;
 	struct cli_args args = {
 		.names_start = &empty_name,
 		.names_end   = &empty_name,
 		.ethers_path = ethers_path,
+		.shard       = shard,
+		.export_path = NULL,
+		.owner       = NULL,
+		.lease_count = 0,
+		.lease_seconds = LEASE_SECONDS,
 		.min_mac     = { .octet = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x00 } },
 		.max_mac     = { .octet = { 0x02, 0x00, 0xff, 0xff, 0xff, 0xff } },
+		.compact     = false,
+		.compact_by_name = false,
+		.follow      = false,
 		.help        = false,
+		.lookup      = false,
+		.query       = false,
 		.quiet       = false,
+		.release     = false,
+		.report      = false,
+		.shared      = false,
 		.usage       = false,
 		.verbose     = false
 	};
 
-	// Process the CLI options using traditional getopt(3).
+	// Process the CLI options using getopt_long(3).
+	// Only options without a fitting short option letter have a long form.
 	// There are no mandatory options.
+	static const struct option long_options[] = {
+		{ .name = "compact"   , .has_arg = optional_argument, .flag = NULL, .val = 'c'               },
+		{ .name = "export-bin", .has_arg = required_argument, .flag = NULL, .val = OPTION_EXPORT_BIN },
+		{ .name = NULL        , .has_arg = no_argument      , .flag = NULL, .val = 0                 }
+	};
 	int option;
-	while ((option = getopt(argc, argv, "hqvm:M:f:")) != -1) {
+	while ((option = getopt_long(argc, argv, "hlgquvDSFc::m:M:f:s:o:L:", long_options, NULL)) != -1) {
 		switch (option) {
 		case 'h': // The help option takes no argument.
 			args.help  = true;
@@ -212,6 +360,41 @@ parse_cli_args(int argc, char **argv)
 			args.quiet   = true;
 			break;
 
+		case 'l': // The lookup option takes no argument.
+			args.lookup = true;
+			break;
+
+		case 'g': // The query option takes no argument.
+			args.query = true;
+			break;
+
+		case 'D': // The release option takes no argument.
+			args.release = true;
+			break;
+
+		case 'S': // The shared allocator option takes no argument.
+			args.shared = true;
+			break;
+
+		case 'c': // The compact option takes an optional sort key argument.
+			args.compact = true;
+			if (optarg == NULL || !strcmp(optarg, "address")) {
+				args.compact_by_name = false;
+			} else if (!strcmp(optarg, "name")) {
+				args.compact_by_name = true;
+			} else {
+				xo_errx(EX_USAGE, "Invalid -c <key> argument '%s' (expected 'address' or 'name')", optarg);
+			}
+			break;
+
+		case 'F': // The follow option takes no argument.
+			args.follow = true;
+			break;
+
+		case 'u': // The report option takes no argument.
+			args.report = true;
+			break;
+
 		case 'v': // The verbose option takes no argument.
 			args.verbose = true;
 			args.quiet   = false;
@@ -226,6 +409,37 @@ parse_cli_args(int argc, char **argv)
 			args.ethers_path = optarg;
 			break;
 
+		case 's': // The shard option argument must be a file name (not empty, no slashes, no leading dot).
+			if (optarg[0] == '\0' || optarg[0] == '.' || strchr(optarg, '/') != NULL) {
+				xo_errx(EX_DATAERR, "Invalid -s <shard> argument '%s'", optarg);
+			} else if (strlen(optarg) >= NAME_MAX) {
+				xo_errx(EX_DATAERR, "The -s <shard> argument is too long.");
+			}
+			args.shard = optarg;
+			break;
+
+		case OPTION_EXPORT_BIN: // The export option argument must be a possible path (not empty, not too long).
+			if (optarg[0] == '\0') {
+				xo_errx(EX_DATAERR, "The --export-bin <out> argument is empty.");
+			} else if (strlen(optarg) >= PATH_MAX) {
+				xo_errx(EX_DATAERR, "The --export-bin <out> argument is too long.");
+			}
+			args.export_path = optarg;
+			break;
+
+		case 'o': // The owner option argument must be a valid hostname.
+			args.owner = optarg;
+			if (!is_owner(optarg)) {
+				xo_errx(EX_DATAERR, "Invalid -o <owner> argument '%s'", optarg);
+			}
+			break;
+
+		case 'L': // The lease option argument is a power of two count optionally followed by the seconds the lease lasts.
+			if (!parse_lease(optarg, &args.lease_count, &args.lease_seconds)) {
+				xo_errx(EX_DATAERR, "Invalid -L <count>[:<seconds>] argument '%s' (expected a power of two count lasting more than %d seconds)", optarg, LEASE_MARGIN);
+			}
+			break;
+
 		case 'm': // The minimum MAC address option argument must be a valid MAC address.
 			if (is_null(scan_addr(valid_string(optarg), &args.min_mac))) {
 				xo_errx(EX_DATAERR, "Invalid -m <min_mac> argument '%s'", optarg);
@@ -253,6 +467,27 @@ parse_cli_args(int argc, char **argv)
 		args.names_end   = (const char *_Nonnull const *_Nonnull const) &argv[argc];
 	}
 
+	// At most one mode may be selected instead of allocating.
+	const int modes = args.follow + args.compact + (args.export_path != NULL) + args.query + args.report + args.release + args.lookup;
+	if (modes > 1) {
+		xo_errx(EX_USAGE, "The -F, -c, --export-bin, -g, -u, -D and -l options are mutually exclusive.");
+	}
+
+	// The shared allocator only allocates.
+	if (args.shared && modes != 0) {
+		xo_errx(EX_USAGE, "The -S option can't be combined with -F, -c, --export-bin, -g, -u, -D or -l.");
+	}
+
+	// Leases are reserved for an owner.
+	if (args.lease_count != 0 && args.owner == NULL) {
+		xo_errx(EX_USAGE, "The -L <count> option requires an -o <owner>.");
+	}
+
+	// Leases are tracked by the private allocator only.
+	if (args.shared && args.owner != NULL) {
+		xo_errx(EX_USAGE, "The -S and -o <owner> options are mutually exclusive.");
+	}
+
 	// The minimum MAC address address must not be larger than the maximum MAC address.
 	if (memcmp(&args.min_mac, &args.max_mac, sizeof(struct ether_addr)) > 0) {
 		xo_errx(EX_DATAERR, "The -m <min_mac> argument is larger than the -M <max_mac> argument");
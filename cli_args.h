@@ -6,6 +6,7 @@
 // Include system headers from subdirectories.
 #include <net/ethernet.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #if __STDC_VERSION__ >= 202311L
 static_assert(true); // Workaround for https://github.com/clangd/clangd/issues/1167
@@ -37,18 +38,33 @@ static_assert(true); // Workaround for https://github.com/clangd/clangd/issues/1
 // Define string constants as macros (constexpr is a C23 feature).
 #define PROG_NAME   "ethers"
 #define ETHERS_PATH "/etc/ethers"
+#define SHARD_NAME  "local"
 
 struct cli_args {
 	const char *_Nonnull const *_Nonnull names_start;
 	const char *_Nonnull const *_Nonnull names_end;
 
 	const char *_Nonnull  ethers_path;
+	const char *_Nonnull  shard;
+	const char *_Nullable export_path;
+	const char *_Nullable owner;
+
+	uint64_t              lease_count;
+	uint64_t              lease_seconds;
 
 	struct ether_addr     min_mac;
 	struct ether_addr     max_mac;
 
+	bool                  compact;
+	bool                  compact_by_name;
+	bool                  follow;
 	bool                  help;
+	bool                  lookup;
+	bool                  query;
 	bool                  quiet;
+	bool                  release;
+	bool                  report;
+	bool                  shared;
 	bool                  usage;
 	bool                  verbose;
 };
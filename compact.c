@@ -0,0 +1,219 @@
+// vim: ft=c:ts=8 :
+
+#include "arena.h"
+#include "compact.h"
+#include "ethers_file.h"
+#include "lease.h"
+
+// Include library headers
+#include <libxo/xo.h>
+
+// Include system headers from subdirectories.
+#include <net/ethernet.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+
+// Include system headers
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+
+#if __STDC_VERSION__ >= 202311L
+static_assert(true); // Workaround for https://github.com/clangd/clangd/issues/1167
+#endif 
+
+#pragma clang diagnostic push
+
+// Set *very* aggressive diagnostics specific to clang (version 19.1.3).
+// These diagnostics aren't stable between compiler versions.
+// If used like this they're **EXPECTED** to break break the build,
+// but they're also useful for catching errors.
+// Use `make debug` to build with these diagnostics.
+#ifdef RACONIC
+#pragma clang diagnostic error   "-Weverything"
+#pragma clang diagnostic ignored "-Wunsafe-buffer-usage"
+#pragma clang diagnostic ignored "-Wdeclaration-after-statement"
+#pragma clang diagnostic ignored "-Wpre-c11-compat"
+#pragma clang diagnostic ignored "-Wpre-c23-compat"
+#pragma clang diagnostic ignored "-Wc2y-extensions"
+#pragma clang diagnostic ignored "-Wc++98-compat"
+#pragma clang diagnostic ignored "-Wnullability-extension"
+#pragma clang diagnostic ignored "-Wvla"
+#pragma clang diagnostic ignored "-Wgnu-statement-expression"
+#pragma clang diagnostic ignored "-Wgnu-conditional-omitted-operand"
+#pragma clang diagnostic ignored "-Wgnu-case-range"
+#pragma clang diagnostic ignored "-Wgnu-designator"
+#endif
+
+static void
+records_add(struct records records[const static 1], const struct ether_addr addr[const static 1], const struct valid name, const bool release)
+{
+	if (records->count == records->capacity) {
+		const size_t capacity = records->capacity == 0 ? 1024 : 2 * records->capacity;
+		records->record   = arena_grow(records->arena, records->record, records->count, capacity, sizeof(struct record));
+		records->capacity = capacity;
+	}
+	records->record[records->count] = (struct record) {
+		.addr     = *addr,
+		.release  = release,
+		.sequence = records->count,
+		.name     = name
+	};
+	records->count++;
+}
+
+static int
+compare_name_sequence(const void *_Nonnull const a, const void *_Nonnull const b)
+{
+	const struct record *_Nonnull const left  = a;
+	const struct record *_Nonnull const right = b;
+	const int order = valid_compare(left->name, right->name);
+	if (order != 0) {
+		return order;
+	}
+	return (left->sequence > right->sequence) - (left->sequence < right->sequence);
+}
+
+static int
+compare_name(const void *_Nonnull const a, const void *_Nonnull const b)
+{
+	const struct record *_Nonnull const left  = a;
+	const struct record *_Nonnull const right = b;
+	const int order = valid_compare(left->name, right->name);
+	return order != 0 ? order : memcmp(&left->addr, &right->addr, sizeof(left->addr));
+}
+
+static int
+compare_addr(const void *_Nonnull const a, const void *_Nonnull const b)
+{
+	const struct record *_Nonnull const left  = a;
+	const struct record *_Nonnull const right = b;
+	const int order = memcmp(&left->addr, &right->addr, sizeof(left->addr));
+	return order != 0 ? order : valid_compare(left->name, right->name);
+}
+
+// Replay the records of each hostname in file order with the same rules as a lookup:
+// the first mapping of a hostname wins until a release record for it drops it.
+// Returns the number of live mappings moved to the front of the array.
+static size_t
+replay_records(struct record record[const], const size_t count)
+{
+	qsort(record, count, sizeof(struct record), compare_name_sequence);
+
+	size_t live = 0;
+	for (size_t first = 0, last; first < count; first = last) {
+		const struct record *_Nullable mapping = NULL;
+		for (last = first; last < count && !valid_compare(record[first].name, record[last].name); last++) {
+			const struct record *_Nonnull const current = &record[last];
+			if (!current->release && mapping == NULL) {
+				mapping = current;
+			} else if (current->release && mapping != NULL && !memcmp(&mapping->addr, &current->addr, sizeof(current->addr))) {
+				mapping = NULL;
+			}
+		}
+		if (mapping != NULL) {
+			record[live++] = *mapping;
+		}
+	}
+	return live;
+}
+
+// Append every record left in the reader to the records.
+void
+read_records(struct records records[const static 1], struct ethers_reader reader[const static 1])
+{
+	ssize_t           delta;
+	struct ether_addr addr[1];
+	char              name[MAXHOSTNAMELEN];
+	reader->leases = true;
+	for (delta = ethers_reader_read(reader, addr, name); delta > 0; delta = ethers_reader_read(reader, addr, name)) {
+		if (delta == ETHERS_LEASE) {
+			leases_add(&records->leases, addr, name, reader->lease);
+		} else {
+			records_add(records, addr, reader->name, delta == ETHERS_RELEASE);
+		}
+	}
+	if (delta < 0) {
+		xo_err(EX_DATAERR, "Failed read in line %zu of ethers file '%s'.", reader->line_number, reader->file->path);
+	}
+}
+
+// Move the live mappings to the front of the records sorted by MAC address or hostname.
+// Returns the number of live mappings.
+size_t
+live_records(struct records records[const static 1], const bool by_name)
+{
+	struct record *_Nullable const record = records->record;
+	const size_t                   live   = record == NULL ? 0 : replay_records(record, records->count);
+	if (live != 0) {
+		qsort(record, live, sizeof(struct record), by_name ? compare_name : compare_addr);
+	}
+	return live;
+}
+
+// Rewrite the ethers file with only the live mappings sorted by MAC address or hostname.
+// The new file is written to a temporary file in the same directory and renamed over the
+// old file while holding the exclusive lock used by the writers.
+void
+ethers_compact(const struct ethers_file file[const static 1], const bool by_name)
+{
+	const char *_Nonnull const path = file->path;
+
+	(void)ethers_file_lock(file);
+
+	// Map the file again under the exclusive lock to include all appended lines.
+	const struct valid    map = ethers_mmap(file->fd, path);
+	struct ethers_reader reader = ethers_reader_create(file);
+	reader.input = map;
+
+	struct arena   arena   __attribute__((cleanup(arena_cleanup))) = ARENA_INIT;
+	struct records records = RECORDS_INIT(&arena);
+	read_records(&records, &reader);
+	struct record *_Nullable const record = records.record;
+	const size_t                   live   = live_records(&records, by_name);
+	for (size_t i = 1; !by_name && i < live; i++) {
+		if (!memcmp(&record[i - 1].addr, &record[i].addr, sizeof(record[i].addr))) {
+			char buffer[sizeof("xx:xx:xx:xx:xx:xx")];
+			xo_warnx("MAC address %s is mapped to more than one hostname.", ether_ntoa_r(&record[i].addr, buffer));
+		}
+	}
+
+	struct stat stat_buffer;
+	if (fstat(file->fd, &stat_buffer) != 0) {
+		xo_err(EX_IOERR, "Failed to fstat() ethers file '%s'", path);
+	}
+	struct ethers_replace replace = ethers_replace_open(path, "ethers file", stat_buffer.st_mode & ALLPERMS);
+	FILE *_Nonnull const  stream  = replace.stream;
+
+	// Record the length of the sorted lines in a header comment for lookups to bisect them.
+	size_t sorted = 0;
+	for (size_t i = 0; i < live; i++) {
+		sorted += sizeof("xx:xx:xx:xx:xx:xx \n") - 1 + valid_length(record[i].name);
+	}
+	bool failed = fprintf(stream, "# " ETHERS_SORTED_MARKER " %s %zu\n", by_name ? "name" : "address", sorted) < 0;
+	for (size_t i = 0; !failed && i < live; i++) {
+		failed = ethers_print(stream, &record[i].addr, record[i].name) < 0;
+	}
+
+	// Keep the leases that haven't expired yet after the sorted lines.
+	const uint64_t now = (uint64_t)time(NULL);
+	for (size_t i = 0; !failed && i < records.leases.count; i++) {
+		const struct lease *_Nonnull const lease = &records.leases.lease[i];
+		if (lease_live(lease, now)) {
+			const struct ethers_lease fields = { .count = lease->count, .expires = lease->expires };
+			failed = ethers_print_lease(stream, &lease->first, lease->owner, fields) < 0;
+		}
+	}
+	ethers_replace_commit(&replace, failed);
+
+	if (xo_emit("{Lc:Compacted}{P: }{:records/%zu}{L: records into }{:entries/%zu}{L: entries}\n", records.count, live) < 0) {
+		xo_err(EX_IOERR, "Failed to emit compaction summary");
+	}
+
+	ethers_unmap(map);
+}
+
+#pragma clang diagnostic pop
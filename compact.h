@@ -0,0 +1,78 @@
+// vim: ft=c:ts=8 :
+
+#ifndef COMPACT_H
+#define COMPACT_H
+
+#include <sys/param.h>
+#include <net/ethernet.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "arena.h"
+#include "ethers_file.h"
+#include "lease.h"
+
+#if __STDC_VERSION__ >= 202311L
+static_assert(true); // Workaround for https://github.com/clangd/clangd/issues/1167
+#endif 
+
+#pragma clang diagnostic push
+
+// Set *very* aggressive diagnostics specific to clang (version 19.1.3).
+// These diagnostics aren't stable between compiler versions.
+// If used like this they're **EXPECTED** to break break the build,
+// but they're also useful for catching errors.
+// Use `make debug` to build with these diagnostics.
+#ifdef RACONIC
+#pragma clang diagnostic error   "-Weverything"
+#pragma clang diagnostic ignored "-Wunsafe-buffer-usage"
+#pragma clang diagnostic ignored "-Wdeclaration-after-statement"
+#pragma clang diagnostic ignored "-Wpre-c11-compat"
+#pragma clang diagnostic ignored "-Wpre-c23-compat"
+#pragma clang diagnostic ignored "-Wc2y-extensions"
+#pragma clang diagnostic ignored "-Wc++98-compat"
+#pragma clang diagnostic ignored "-Wnullability-extension"
+#pragma clang diagnostic ignored "-Wvla"
+#pragma clang diagnostic ignored "-Wgnu-statement-expression"
+#pragma clang diagnostic ignored "-Wgnu-conditional-omitted-operand"
+#pragma clang diagnostic ignored "-Wgnu-case-range"
+#pragma clang diagnostic ignored "-Wgnu-designator"
+#endif
+
+// Every record read from the ethers file in file order and the leases.
+// The records are allocated from the arena, their hostnames are slices of the mapped files
+// (not NUL terminated) which have to stay mapped as long as the records are used.
+struct record {
+	struct ether_addr addr;
+	bool              release;
+	size_t            sequence;
+	struct valid      name;
+};
+
+// Copy out the hostname of a record NUL terminated.
+static inline const char *_Nonnull
+record_name(const struct record record[const static 1], char name[const static MAXHOSTNAMELEN])
+{
+	const size_t length = valid_length(record->name);
+	memcpy(name, record->name.start, length);
+	name[length] = '\0';
+	return name;
+}
+
+struct records {
+	struct arena  *_Nonnull  arena;
+	struct record *_Nullable record;
+	size_t                   count;
+	size_t                   capacity;
+	struct leases            leases;
+};
+
+#define RECORDS_INIT(arena_) ((struct records) { .arena = (arena_), .record = NULL, .count = 0, .capacity = 0, .leases = LEASES_INIT(arena_) })
+
+void   read_records(struct records records[const static 1], struct ethers_reader reader[const static 1]);
+size_t live_records(struct records records[const static 1], bool by_name);
+void   ethers_compact(const struct ethers_file file[const static 1], bool by_name);
+
+#pragma clang diagnostic pop
+#endif /* COMPACT_H */
@@ -1,5 +1,6 @@
 // vim: ft=c:ts=8 :
 
+#include "arena.h"
 #include "ethers_file.h"
 #include "scan.h"
 
@@ -14,13 +15,18 @@
 #include <sys/stat.h>
 
 // Include system headers
+#include <dirent.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <libgen.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
 #include <unistd.h>
 
 #if __STDC_VERSION__ >= 202311L
@@ -50,7 +56,7 @@ static_assert(true); // Workaround for https://github.com/clangd/clangd/issues/1
 #pragma clang diagnostic ignored "-Wgnu-designator"
 #endif
 
-static void
+void
 ethers_unmap(const struct valid map)
 {
 	if (!is_empty(map)) {
@@ -79,7 +85,7 @@ ethers_file_cleanup(const struct ethers_file file[const static 1])
 	ethers_file_close(*file);
 }
 
-static struct valid
+struct valid
 ethers_mmap(const int fd, const char path[static const 1])
 {
 	const size_t size = ({
@@ -107,9 +113,8 @@ ethers_mmap(const int fd, const char path[static const 1])
 }
 
 static int
-ethers_create(const struct cli_args args[static 1])
+ethers_create(const char path[static 1])
 {
-	const char *_Nonnull const path = args->ethers_path;
 	const int                  flags = O_RDWR | O_SHLOCK | O_DSYNC | O_CREAT | O_APPEND;
 	const mode_t               perms = 0644;
 	const size_t               size = strlen(path) + 1;
@@ -147,91 +152,315 @@ ethers_create(const struct cli_args args[static 1])
 	return valid_fd;
 }
 
-struct ethers_file
-ethers_file_open(const struct cli_args args[const static 1])
+// How ethers_open() opens a file:
+// appending (created if missing), only reading the selected file or reading another shard.
+// Other shards aren't locked, a writer of another shard holding a shared lock on
+// them while upgrading its own shard's lock would deadlock with that shard's writer.
+#define ETHERS_OPEN_APPEND 0
+#define ETHERS_OPEN_READ   1
+#define ETHERS_OPEN_SHARD  2
+
+static struct ethers_file
+ethers_open(const struct cli_args args[const static 1], const char path[const static 1], const int mode)
 {
-	const char *_Nonnull const path  = args->ethers_path;
-	const int                  flags = O_RDWR | O_SHLOCK | O_DSYNC | O_APPEND;
+	const int                  flags = mode == ETHERS_OPEN_APPEND ? O_RDWR | O_SHLOCK | O_DSYNC | O_APPEND :
+	                                   mode == ETHERS_OPEN_READ   ? O_RDONLY | O_SHLOCK : O_RDONLY;
 
 	const int valid_fd = ({
 		const int maybe_fd = openat(AT_FDCWD, path, flags);
 
-		if (maybe_fd < 0 && errno != ENOENT) {
+		// Failing to read the selected file must not look like a file without mappings.
+		if (maybe_fd < 0 && mode == ETHERS_OPEN_READ) {
+			xo_err(errno == EACCES ? EX_NOPERM : EX_NOINPUT, "Failed to open ethers file '%s'", path);
+		} else if (maybe_fd < 0 && (errno != ENOENT || mode == ETHERS_OPEN_SHARD)) {
 			xo_warn("Failed to open ethers file '%s'", path);
 			return (struct ethers_file) {
 				.args     = args,
+				.path     = path,
 				.map      = empty,
+				.snapshot = SNAPSHOT_NONE,
 				.fd       = -1,
 				.reserved = 0
 			};
 		}
 
-		maybe_fd >= 0 ? maybe_fd : ethers_create(args);
+		maybe_fd >= 0 ? maybe_fd : ethers_create(path);
 	});
 
-	const struct valid map = ethers_mmap(valid_fd, args->ethers_path);
+	const struct valid map = ethers_mmap(valid_fd, path);
 
 	return (struct ethers_file) {
 		.args     = args,
+		.path     = path,
 		.map      = map,
+		.snapshot = snapshot_map(map, path),
 		.fd       = valid_fd,
 		.reserved = 0
 	};
 }
 
+struct ethers_file
+ethers_file_open(const struct cli_args args[const static 1], const char path[const static 1])
+{
+	return ethers_open(args, path, ETHERS_OPEN_APPEND);
+}
+
+// Open an existing ethers file only for reading (e.g. to follow it after it was replaced).
+struct ethers_file
+ethers_file_reopen(const struct cli_args args[const static 1], const char path[const static 1])
+{
+	return ethers_open(args, path, ETHERS_OPEN_SHARD);
+}
+
+static int
+compare_paths(const void *_Nonnull const a, const void *_Nonnull const b)
+{
+	return strcmp(a, b);
+}
+
+// List the shards in a directory: all regular files not starting with a dot (e.g. temporary files).
+// The writable shard is included even if it doesn't exist yet if it's going to be created on open.
+static size_t
+ethers_list(const struct cli_args args[const static 1], const bool create, char (*_Nullable paths[const static 1])[PATH_MAX])
+{
+	const char *_Nonnull const dir_path = args->ethers_path;
+	const char *_Nonnull const shard    = args->shard;
+	size_t                     count    = 0;
+	size_t                     capacity = 0;
+	bool                       writable = false;
+
+	DIR *_Nullable const dir = opendir(dir_path);
+	if (dir == NULL) {
+		xo_err(EX_NOINPUT, "Failed to open ethers directory '%s'", dir_path);
+	}
+	for (;;) {
+		errno = 0;
+		const struct dirent *_Nullable const entry = readdir(dir);
+		struct stat                          stat_buffer;
+		// Once all entries have been read the writable shard is added unless it has been seen already.
+		if (entry == NULL) {
+			if (errno != 0) {
+				xo_err(EX_IOERR, "Failed to read ethers directory '%s'", dir_path);
+			} else if (writable || !create) {
+				break;
+			}
+		} else if (entry->d_name[0] == '.') {
+			continue;
+		} else if (fstatat(dirfd(dir), entry->d_name, &stat_buffer, 0) != 0) {
+			xo_err(EX_IOERR, "Failed to fstatat() shard '%s' in ethers directory '%s'", entry->d_name, dir_path);
+		} else if (!S_ISREG(stat_buffer.st_mode)) {
+			continue;
+		}
+
+		const char *_Nonnull const name = entry != NULL ? entry->d_name : shard;
+		writable |= !strcmp(name, shard);
+		if (count == capacity) {
+			capacity = capacity == 0 ? 16 : 2 * capacity;
+			char (*_Nullable const grown)[PATH_MAX] = reallocarray(*paths, capacity, PATH_MAX);
+			if (grown == NULL) {
+				xo_err(EX_OSERR, "Failed to allocate %zu shard paths", capacity);
+			}
+			*paths = grown;
+		}
+		const int length = snprintf((*paths)[count], PATH_MAX, "%s/%s", dir_path, name);
+		if (length < 0 || length >= PATH_MAX) {
+			xo_errx(EX_CONFIG, "The path of shard '%s' in ethers directory '%s' is too long", name, dir_path);
+		}
+		count++;
+	}
+	if (closedir(dir) != 0) {
+		xo_err(EX_IOERR, "Failed to close ethers directory '%s'", dir_path);
+	}
+
+	qsort(*paths, count, PATH_MAX, compare_paths);
+	return count;
+}
+
+// Only allocating, releasing and compacting write to the ethers file.
+static bool
+ethers_writes(const struct cli_args args[const static 1])
+{
+	return !(args->lookup || args->query || args->report || args->follow || args->export_path != NULL);
+}
+
+// Open either a single ethers file or all shards in an ethers directory.
+// Modes that never write open the selected file read-only and don't create it.
+// Without the selected shard the first shard of the directory takes its place.
+struct ethers_files
+ethers_files_open(const struct cli_args args[const static 1])
+{
+	const char *_Nonnull const path   = args->ethers_path;
+	const bool                 writes = ethers_writes(args);
+	struct stat                stat_buffer;
+	char (*_Nullable paths)[PATH_MAX] = NULL;
+	size_t                     count  = 1;
+	size_t                     writable = 0;
+
+	if (stat(path, &stat_buffer) == 0 && S_ISDIR(stat_buffer.st_mode)) {
+		count = ethers_list(args, writes, &paths);
+		if (count == 0) {
+			xo_errx(EX_NOINPUT, "The ethers directory '%s' contains no shards.", path);
+		}
+		while (writable < count && strcmp(strrchr(paths[writable], '/') + 1, args->shard) != 0) {
+			writable++;
+		}
+		writable = writable < count ? writable : 0;
+	}
+
+	struct ethers_file *_Nullable const file = calloc(count, sizeof(struct ethers_file));
+	if (file == NULL) {
+		xo_err(EX_OSERR, "Failed to allocate %zu ethers files", count);
+	}
+	for (size_t i = 0; i < count; i++) {
+		const int                mode   = i != writable ? ETHERS_OPEN_SHARD : writes ? ETHERS_OPEN_APPEND : ETHERS_OPEN_READ;
+		const struct ethers_file opened = ethers_open(args, paths != NULL ? paths[i] : path, mode);
+		memcpy(&file[i], &opened, sizeof(opened));
+	}
+
+	return (struct ethers_files) {
+		.file     = file,
+		.paths    = paths,
+		.count    = count,
+		.writable = writable
+	};
+}
+
+void
+ethers_files_close(const struct ethers_files files)
+{
+	for (size_t i = 0; i < files.count; i++) {
+		ethers_file_close(files.file[i]);
+	}
+	free(files.file);
+	free(files.paths);
+}
+
+void
+ethers_files_cleanup(const struct ethers_files files[const static 1])
+{
+	ethers_files_close(*files);
+}
+
 struct ethers_reader
 ethers_reader_create(const struct ethers_file *_Nonnull const file)
 {
 	return (struct ethers_reader) {
 		.file        = file,
-		.input       = file->map,
-		.line_number = 0
+		.input       = is_snapshot(&file->snapshot) ? empty : file->map,
+		.line_number = 0,
+		.leases      = false,
+		.quiet       = false,
+		.error       = ETHERS_LINE_VALID,
+		.name        = empty,
+		.lease       = { .count = 0, .expires = 0 }
 	};
 }
 
 struct ethers_writer
-ethers_writer_create(const struct ethers_file file[static const 1], struct ethers_buffer buffer[static const 1])
+ethers_writer_create(const struct ethers_file file[static const 1], struct arena arena[static const 1])
 {
-	const struct ethers_writer writer = {
-		.file   = file,
-		.stream = open_memstream(&buffer->buffer, &buffer->size),
-		.buffer = buffer
+	return (struct ethers_writer) {
+		.file        = file,
+		.arena       = arena,
+		.buffer      = NULL,
+		.size        = 0,
+		.capacity    = 0,
+		.shards      = NULL,
+		.lock_wait   = 0,
+		.seen        = is_empty(file->map) ? 0 : (off_t)(file->map.end - file->map.start),
+		.locked_size = 0,
+		.lock_fd     = -1,
+		.locked      = false,
+		.exclusive   = false,
+		.leased      = false
 	};
+}
 
-	if (!writer.stream) {
-		xo_err(EX_OSERR, "Failed open_memstream()");
+// Report why the fields of a line (or the entry of a binary snapshot counted from 1) aren't a mapping.
+void
+ethers_reader_warn(const struct ethers_file file[const static 1], const int error, const size_t line_number)
+{
+	const char *_Nonnull const ethers_path = file->path;
+	if (is_snapshot(&file->snapshot)) {
+		xo_warnx("Invalid name of entry %zu in binary snapshot '%s'.", line_number - 1, ethers_path);
+		return;
+	}
+	switch (error) {
+	case ETHERS_LINE_ADDR:
+		xo_warnx("Invalid MAC address in line %zu of ethers file '%s'.", line_number, ethers_path);
+		break;
+	case ETHERS_LINE_WHITESPACE:
+		xo_warnx("Missing whitespace between MAC address and name in line %zu of ethers file '%s'.", line_number, ethers_path);
+		break;
+	case ETHERS_LINE_NAME:
+		xo_warnx("Invalid name in line %zu of ethers file '%s'.", line_number, ethers_path);
+		break;
+	case ETHERS_LINE_LONG_NAME:
+		xo_warnx("The hostname in line %zu of ethers file '%s' is too long.", line_number, ethers_path);
+		break;
+	default:
+		xo_warnx("Too many fields on line %zu of ethers file '%s'.", line_number, ethers_path);
+		break;
+	}
+}
+
+// Parse the fields of a lease record into the reader's lease, the first address and the owner.
+// Returns false if the fields aren't a lease record after all (e.g. "# lease renewal on friday").
+static bool
+read_lease(struct ethers_reader reader[const static 1], const struct valid fields,
+           struct ether_addr addr[const static 1], char owner[const static MAXHOSTNAMELEN])
+{
+	struct maybe name = none;
+	struct maybe rest = scan_addr(fields, addr);
+	rest = is_null(rest) ? none : scan_count(or_empty(rest), &reader->lease.count);
+	rest = is_null(rest) ? none : scan_name(or_empty(rest), &name);
+	rest = is_null(rest) ? none : scan_count(or_empty(rest), &reader->lease.expires);
+	if (is_null(rest) || !is_empty(trim_left_whitespace(or_empty(rest)))) {
+		return false;
 	}
 
-	return writer;
+	const size_t length = (size_t)(name.end - name.start);
+	if (length >= MAXHOSTNAMELEN) {
+		return false;
+	}
+	memcpy(owner, name.start, length);
+	owner[length] = '\0';
+	return true;
 }
 
-static struct valid
-trim_left_whitespace(struct valid valid)
+// Record why reading failed and warn about it unless the reader is quiet.
+static ssize_t
+reader_fail(struct ethers_reader reader[const static 1], const int error)
 {
-	for (; valid.start != valid.end; valid.start++) {
-		const char byte = valid.start[0];
-		if (byte != '\t' && byte != '\n' && byte != ' ') {
-			return valid;
-		}
+	reader->error = error;
+	if (!reader->quiet) {
+		ethers_reader_warn(reader->file, error, reader->line_number);
 	}
-	return valid;
+	return -1;
 }
 
 // Attempt to read the next line and the MAC address and hostname.
-// Returns none on error and the remaining input on success.
+// Returns -1 on error, 0 at the end of the input and the record kind
+// (ETHERS_ENTRY, ETHERS_RELEASE or ETHERS_LEASE if enabled) on success.
 // On success the MAC address and hostname are copied out to fixed size buffers.
+// Binary snapshots are read entry by entry instead (counted as lines).
 //
 // (It's a cleaner ether_line(3) reimplementation).
 ssize_t
 ethers_reader_read(struct ethers_reader reader[const static 1], struct ether_addr addr[const static 1], char name[const static MAXHOSTNAMELEN])
 {
-	// Dig through indirections for the input file path and line number to use in error messages.
-	const struct ethers_file *_Nonnull const file        = reader->file;
-	const struct cli_args    *_Nonnull const args        = file->args;
-	const char               *_Nonnull const ethers_path = args->ethers_path;
-	size_t                                   line_number;
+	const struct ethers_file *_Nonnull const file = reader->file;
 
-retry:	line_number = ++(reader->line_number);
+	if (is_snapshot(&file->snapshot)) {
+		const ssize_t delta = snapshot_read(&file->snapshot, reader->line_number++, addr, &reader->name);
+		if (delta > 0) {
+			memcpy(name, reader->name.start, valid_length(reader->name));
+			name[valid_length(reader->name)] = '\0';
+		}
+		return delta < 0 ? reader_fail(reader, ETHERS_LINE_NAME) : delta;
+	}
+
+retry:	reader->line_number++;
 	if (is_empty(reader->input)) {
 		return 0;
 	}
@@ -244,111 +473,500 @@ retry:	line_number = ++(reader->line_number);
 	// Split input into a line of whitespace separated fields
 	// followed by an optional comment.
 	const struct split comment = split_comment(input.before);
-	const struct valid line    = comment.before;
+	struct valid       line    = comment.before;
+	ssize_t            record  = ETHERS_ENTRY;
+
+	// Skip over empty lines (no fields only whitespaces or comments)
+	// unless the comment is a release record.
+	if (is_empty(trim_left_whitespace(line))) {
+		const struct maybe released = ethers_line_marker(comment.after, ETHERS_RELEASE_MARKER);
+		const struct maybe leased   = reader->leases && is_null(released) ? ethers_line_marker(comment.after, ETHERS_LEASE_MARKER) : none;
+		if (!is_null(leased)) {
+			if (read_lease(reader, or_empty(leased), addr, name)) {
+				return ETHERS_LEASE;
+			}
+			goto retry;
+		} else if (is_null(released)) {
+			goto retry;
+		}
+		line   = or_empty(released);
+		record = ETHERS_RELEASE;
+	}
 
-	// Skip over empty lines (no fields only whitespaces or comments).
-	struct valid field = trim_left_whitespace(line);
-	if (is_empty(field)) {
+	// Copy out the MAC address and hostname.
+	// Comments that merely start with the release marker (e.g. "# release notes") are skipped like any other comment.
+	struct maybe maybe_name = none;
+	const int    error      = ethers_line_mapping(line, addr, &maybe_name);
+	if (error != ETHERS_LINE_VALID && record == ETHERS_RELEASE) {
 		goto retry;
+	} else if (error != ETHERS_LINE_VALID) {
+		return reader_fail(reader, error);
 	}
+	const size_t name_length = (size_t)(maybe_name.end - maybe_name.start);
+	memcpy(name, maybe_name.start, name_length);
+	name[name_length] = '\0';
+	reader->name = or_empty(maybe_name);
 
-	// Extract MAC address out of the 1st field on the line.
-	struct maybe space = scan_addr(line, addr);
-	if (is_null(space)) {
-		xo_warnx("Invalid MAC address in line %zu of ethers file '%s'.", line_number, ethers_path);
-		return -1;
+	return record;
+}
+
+// Locate the sorted lines recorded in the header comment written by compaction.
+// Files without a (valid) header are an unsorted tail.
+struct ethers_sorted
+ethers_sorted(const struct ethers_file file[const static 1])
+{
+	static const char          marker[] = "# " ETHERS_SORTED_MARKER " ";
+	const struct ethers_sorted unsorted = { .lines = empty, .tail = file->map, .by_name = false };
+	const struct valid         map      = file->map;
+	const struct split         header   = split_line(map);
+	struct valid               field    = header.before;
+	if (is_snapshot(&file->snapshot) || is_null(header.after)) {
+		return unsorted;
+	} else if (valid_length(field) <= sizeof(marker) - 1 || memcmp(field.start, marker, sizeof(marker) - 1) != 0) {
+		return unsorted;
+	}
+	field.start += sizeof(marker) - 1;
+
+	static const char by_name[]    = "name ";
+	static const char by_address[] = "address ";
+	bool              name         = false;
+	if (valid_length(field) > sizeof(by_name) - 1 && !memcmp(field.start, by_name, sizeof(by_name) - 1)) {
+		field.start += sizeof(by_name) - 1;
+		name         = true;
+	} else if (valid_length(field) > sizeof(by_address) - 1 && !memcmp(field.start, by_address, sizeof(by_address) - 1)) {
+		field.start += sizeof(by_address) - 1;
+	} else {
+		return unsorted;
 	}
 
-	// The MAC address and hostname must be separated by at least one whitespace.
-	field = trim_left_whitespace(or_empty(space));
-	if (field.start == space.start) {
-		xo_warnx("Missing whitespace between MAC address and name in line %zu of ethers file '%s'.", line_number, ethers_path);
-		return -1;
+	const struct valid rest   = or_empty(header.after);
+	size_t             length = 0;
+	for (; field.start != field.end; field.start++) {
+		const char digit = field.start[0];
+		if (digit < '0' || digit > '9' || length > valid_length(rest)) {
+			return unsorted;
+		}
+		length = 10 * length + (size_t)(digit - '0');
+	}
+	if (length > valid_length(rest) || (length != 0 && rest.start[length - 1] != '\n')) {
+		return unsorted;
 	}
 
-	// Locate the hostname (2nd field) on the line.
-	struct maybe maybe_name = none;
-	space = scan_name(field, &maybe_name);
-	const size_t name_length = (size_t)(maybe_name.end - maybe_name.start);
-	if (is_null(space)) {
-		xo_warnx("Invalid name in line %zu of ethers file '%s'.", line_number, ethers_path);
-		return -1;
-	} else if (name_length >= MAXHOSTNAMELEN) {
-		xo_warnx("The hostname in line %zu of ethers file '%s' is too long.", line_number, ethers_path);
-		return -1;
-	} else {
-		memcpy(name, maybe_name.start, name_length);
-		name[name_length] = '\0';
+	return (struct ethers_sorted) {
+		.lines   = VALID(rest.start, &rest.start[length]),
+		.tail    = VALID(&rest.start[length], rest.end),
+		.by_name = name
+	};
+}
+
+// Bisect lines sorted by name for the entry of a hostname.
+// Each step resynchronises on the start of the line containing the midpoint and parses only that line.
+// Any other line (e.g. a comment or blank line edited into the sorted lines) can't be bisected,
+// the caller has to read the file linearly instead.
+int
+ethers_bisect(const struct ethers_file file[const static 1], const struct valid lines, const char name[const static 1], struct ether_addr addr[const static 1])
+{
+	const char *_Nonnull low  = lines.start;
+	const char *_Nonnull high = lines.end;
+	while (low < high) {
+		const char *_Nonnull const middle = &low[(high - low) / 2];
+		const char *_Nullable const before = memrchr(low, '\n', (size_t)(middle - low));
+		const char *_Nonnull const start  = before != NULL ? &before[1] : low;
+		const char *_Nonnull const end    = (const char *)memchr(start, '\n', (size_t)(high - start)) + 1;
+
+		struct ethers_reader reader = ethers_reader_create(file);
+		char                 found[MAXHOSTNAMELEN];
+		reader.input = VALID(start, end);
+		reader.quiet = true;
+		if (ethers_reader_read(&reader, addr, found) != ETHERS_ENTRY) {
+			return ETHERS_BISECT_UNSORTED;
+		}
+
+		const int order = strcmp(found, name);
+		if (order == 0) {
+			return ETHERS_BISECT_FOUND;
+		} else if (order < 0) {
+			low  = end;
+		} else {
+			high = start;
+		}
 	}
+	return ETHERS_BISECT_MISSING;
+}
 
-	// Prohibit further fields on the line.
-	field = trim_left_whitespace(or_empty(space));
-	if (!is_empty(field)) {
-		xo_warnx("Too many fields on line %zu of ethers file '%s'.", line_number, ethers_path);
-		return -1;
+ssize_t
+ethers_print(FILE *_Nonnull const stream, const struct ether_addr addr[const static 1], const struct valid name)
+{
+	return (ssize_t)fprintf(stream, "%02x:%02x:%02x:%02x:%02x:%02x %.*s\n",
+		addr->octet[0], addr->octet[1], addr->octet[2], addr->octet[3], addr->octet[4], addr->octet[5], (int)valid_length(name), name.start
+	);
+}
+
+ssize_t
+ethers_print_lease(FILE *_Nonnull const stream, const struct ether_addr addr[const static 1], const char owner[const static 1],
+                   const struct ethers_lease lease)
+{
+	return (ssize_t)fprintf(stream, "# " ETHERS_LEASE_MARKER " %02x:%02x:%02x:%02x:%02x:%02x %" PRIu64 " %s %" PRIu64 "\n",
+		addr->octet[0], addr->octet[1], addr->octet[2], addr->octet[3], addr->octet[4], addr->octet[5], lease.count, owner, lease.expires
+	);
+}
+
+// Create the temporary file replacing the file at <path> with the given permissions.
+struct ethers_replace
+ethers_replace_open(const char path[const static 1], const char kind[const static 1], const mode_t mode)
+{
+	const size_t size = strlen(path) + 1;
+	char         dir_copy[PATH_MAX];
+	char         base_copy[PATH_MAX];
+	char         temp_path[PATH_MAX];
+
+	memcpy(dir_copy, path, size);
+	memcpy(base_copy, path, size);
+	const char *_Nonnull const dir_path  = dirname(dir_copy);
+	const char *_Nonnull const base_path = basename(base_copy);
+
+	const int dir_fd = open(dir_path, O_DIRECTORY);
+	if (dir_fd < 0) {
+		xo_err(EX_IOERR, "Failed to open directory containing the %s '%s'", kind, path);
+	}
+	const int length = snprintf(temp_path, sizeof(temp_path), "%s/.%s.XXXXXX", dir_path, base_path);
+	if (length < 0 || (size_t)length >= sizeof(temp_path)) {
+		xo_errx(EX_CONFIG, "The temporary file path for %s '%s' is too long", kind, path);
+	}
+	const int temp_fd = mkstemp(temp_path);
+	if (temp_fd < 0) {
+		xo_err(EX_CANTCREAT, "Failed to create temporary file '%s'", temp_path);
+	}
+	FILE *_Nullable const stream = fdopen(temp_fd, "w");
+	if (stream == NULL) {
+		unlink(temp_path);
+		xo_err(EX_OSERR, "Failed to fdopen() temporary file '%s'", temp_path);
+	} else if (fchmod(temp_fd, mode) != 0) {
+		unlink(temp_path);
+		xo_err(EX_IOERR, "Failed to fchmod() temporary file '%s'", temp_path);
+	}
+
+	struct ethers_replace replace = {
+		.stream      = stream,
+		.path        = path,
+		.kind        = kind,
+		.base_offset = strlen(dir_path) + 1,
+		.dir_fd      = dir_fd
+	};
+	memcpy(replace.base_path, base_path, strlen(base_path) + 1);
+	memcpy(replace.temp_path, temp_path, (size_t)length + 1);
+	return replace;
+}
+
+// Sync the replacement and rename it over the file (and sync the directory) unless writing it failed.
+void
+ethers_replace_commit(struct ethers_replace replace[const static 1], bool failed)
+{
+	const char *_Nonnull const temp_path = replace->temp_path;
+	failed = failed || fflush(replace->stream) != 0 || fsync(fileno(replace->stream)) != 0;
+	if (fclose(replace->stream) != 0 || failed) {
+		unlink(temp_path);
+		xo_err(EX_IOERR, "Failed to write temporary file '%s'", temp_path);
+	} else if (renameat(replace->dir_fd, &temp_path[replace->base_offset], replace->dir_fd, replace->base_path) != 0) {
+		unlink(temp_path);
+		xo_err(EX_IOERR, "Failed to rename temporary file over %s '%s'", replace->kind, replace->path);
+	} else if (fsync(replace->dir_fd) != 0) {
+		xo_err(EX_IOERR, "Failed to fsync() directory containing the %s '%s'", replace->kind, replace->path);
+	} else if (close(replace->dir_fd) != 0) {
+		xo_err(EX_IOERR, "Failed to close() directory containing the %s '%s'", replace->kind, replace->path);
 	}
+	replace->dir_fd = -1;
+}
 
-	return 1;
+// Append a formatted line to the write buffer growing it as needed.
+static ssize_t __attribute__((format(printf, 2, 3)))
+ethers_writer_format(struct ethers_writer writer[const static 1], const char format[const static 1], ...)
+{
+	// Reserve room for the longest possible line (a lease record with the longest owner).
+	static const size_t line = sizeof("# " ETHERS_LEASE_MARKER " xx:xx:xx:xx:xx:xx 18446744073709551615  18446744073709551615\n") + MAXHOSTNAMELEN;
+	if (writer->capacity - writer->size < line) {
+		const size_t capacity = MAX(2 * writer->capacity, 64 * line);
+		writer->buffer   = arena_grow(writer->arena, writer->buffer, writer->size, capacity, sizeof(char));
+		writer->capacity = capacity;
+	}
+
+	va_list arguments;
+	va_start(arguments, format);
+	const int length = vsnprintf(&writer->buffer[writer->size], writer->capacity - writer->size, format, arguments);
+	va_end(arguments);
+	if (length < 0 || (size_t)length >= writer->capacity - writer->size) {
+		return -1;
+	}
+	writer->size += (size_t)length;
+	return length;
 }
 
 ssize_t
 ethers_writer_write(struct ethers_writer writer[const static 1], const struct ether_addr addr[const static 1], const char name[const static 1])
 {
-	return (ssize_t)fprintf(writer->stream, "%02x:%02x:%02x:%02x:%02x:%02x %s\n",
+	return ethers_writer_format(writer, "%02x:%02x:%02x:%02x:%02x:%02x %s\n",
 		addr->octet[0], addr->octet[1], addr->octet[2], addr->octet[3], addr->octet[4], addr->octet[5], name
 	);
 }
 
-void
-ethers_buffer_free(struct ethers_buffer buffer[const static 1])
+ssize_t
+ethers_writer_release(struct ethers_writer writer[const static 1], const struct ether_addr addr[const static 1], const char name[const static 1])
 {
-	free(buffer->buffer);
-	buffer->buffer = NULL;
-	buffer->size   = 0;
+	return ethers_writer_format(writer, "# " ETHERS_RELEASE_MARKER " %02x:%02x:%02x:%02x:%02x:%02x %s\n",
+		addr->octet[0], addr->octet[1], addr->octet[2], addr->octet[3], addr->octet[4], addr->octet[5], name
+	);
 }
 
 ssize_t
-ethers_writer_flush(struct ethers_writer writer[const static 1])
+ethers_writer_lease(struct ethers_writer writer[const static 1], const struct ether_addr addr[const static 1], const char owner[const static 1],
+                    const struct ethers_lease lease)
+{
+	return ethers_writer_format(writer, "# " ETHERS_LEASE_MARKER " %02x:%02x:%02x:%02x:%02x:%02x %" PRIu64 " %s %" PRIu64 "\n",
+		addr->octet[0], addr->octet[1], addr->octet[2], addr->octet[3], addr->octet[4], addr->octet[5], lease.count, owner, lease.expires
+	);
+}
+
+// Make sure the path still refers to the opened file.
+// A concurrent compaction could have renamed a new file over it before it was locked.
+static void
+ethers_file_check(const struct ethers_file file[const static 1])
+{
+	struct stat                fd_stat;
+	struct stat                path_stat;
+	const char *_Nonnull const ethers_path = file->path;
+	if (fstat(file->fd, &fd_stat) != 0) {
+		xo_err(EX_IOERR, "Failed to fstat() ethers file '%s'", ethers_path);
+	} else if (stat(ethers_path, &path_stat) != 0 || fd_stat.st_dev != path_stat.st_dev || fd_stat.st_ino != path_stat.st_ino) {
+		xo_errx(EX_TEMPFAIL, "The ethers(5) file '%s' has been replaced concurrently, retry.", ethers_path);
+	}
+}
+
+// Wait for an exclusive lock adding the nanoseconds spent waiting to <lock_wait>.
+static bool
+ethers_flock(const int fd, uint64_t lock_wait[const static 1])
+{
+	struct timespec before;
+	struct timespec after;
+	if (clock_gettime(CLOCK_MONOTONIC, &before) != 0) {
+		xo_err(EX_OSERR, "Failed to read the monotonic clock");
+	} else if (flock(fd, LOCK_EX) != 0) {
+		return false;
+	} else if (clock_gettime(CLOCK_MONOTONIC, &after) != 0) {
+		xo_err(EX_OSERR, "Failed to read the monotonic clock");
+	}
+	*lock_wait += (uint64_t)(after.tv_sec - before.tv_sec) * UINT64_C(1000000000) + (uint64_t)after.tv_nsec - (uint64_t)before.tv_nsec;
+	return true;
+}
+
+// Upgrade to an exclusive lock and make sure the path still refers to the locked file.
+// A concurrent compaction could have renamed a new file over it while waiting for the lock.
+// Returns the nanoseconds spent waiting for the lock.
+uint64_t
+ethers_file_lock(const struct ethers_file file[const static 1])
+{
+	uint64_t lock_wait = 0;
+	if (!ethers_flock(file->fd, &lock_wait)) {
+		xo_err(EX_IOERR, "Failed to lock ethers(5) file for writing: %s", file->path);
+	}
+	ethers_file_check(file);
+	return lock_wait;
+}
+
+// Read the complete lines in [from, to) of a file into the arena.
+static struct valid
+ethers_read_lines(struct arena arena[const static 1], const struct ethers_file file[const static 1], const off_t from, const off_t to)
+{
+	if (to <= from) {
+		return empty;
+	}
+
+	const size_t         appended = (size_t)(to - from);
+	char *_Nonnull const buffer   = arena_alloc(arena, appended, sizeof(char));
+	const ssize_t        length   = pread(file->fd, buffer, appended, from);
+	if (length < 0) {
+		xo_err(EX_IOERR, "Failed to pread() ethers file '%s'", file->path);
+	}
+
+	// An incomplete last line is left to its writer's ftruncate(2).
+	const char *_Nullable const end = memrchr(buffer, '\n', (size_t)length);
+	return end == NULL ? empty : VALID(buffer, &end[1]);
+}
+
+// Concatenate two runs of complete lines in the arena.
+static struct valid
+ethers_concat(struct arena arena[const static 1], const struct valid first, const struct valid second)
+{
+	if (is_empty(first) || is_empty(second)) {
+		return is_empty(first) ? second : first;
+	}
+	char *_Nonnull const buffer = arena_alloc(arena, valid_length(first) + valid_length(second), sizeof(char));
+	memcpy(buffer, first.start, valid_length(first));
+	memcpy(&buffer[valid_length(first)], second.start, valid_length(second));
+	return VALID(buffer, &buffer[valid_length(first) + valid_length(second)]);
+}
+
+// Lock the ethers directory exclusively for the writer and return the lines appended to the other shards since they were read.
+// Writers of different shards only lock their own shard and would allocate the same address otherwise.
+// A shard added, removed or replaced since listing the directory can't be replayed and fails the writer instead.
+static struct valid
+ethers_files_lock(struct ethers_writer writer[const static 1])
+{
+	const struct ethers_files *_Nonnull const files    = writer->shards;
+	const struct cli_args     *_Nonnull const args     = files->file[files->writable].args;
+	const char                *_Nonnull const dir_path = args->ethers_path;
+	char                                      lock_path[PATH_MAX];
+
+	const int length = snprintf(lock_path, sizeof(lock_path), "%s/" ETHERS_LOCK_FILE, dir_path);
+	if (length < 0 || length >= PATH_MAX) {
+		xo_errx(EX_CONFIG, "The path of the lock file in ethers directory '%s' is too long", dir_path);
+	}
+	writer->lock_fd = open(lock_path, O_RDONLY | O_CREAT, 0644);
+	if (writer->lock_fd < 0) {
+		xo_err(EX_CANTCREAT, "Failed to open lock file '%s'", lock_path);
+	} else if (!ethers_flock(writer->lock_fd, &writer->lock_wait)) {
+		xo_err(EX_IOERR, "Failed to lock ethers directory for writing: %s", dir_path);
+	}
+
+	char (*_Nullable paths)[PATH_MAX] = NULL;
+	const size_t count = ethers_list(args, true, &paths);
+	bool         fresh = count == files->count;
+	for (size_t i = 0; fresh && i < count; i++) {
+		fresh = strcmp(paths[i], files->paths[i]) == 0;
+	}
+	free(paths);
+
+	// The writable shard is read by its writer, the others may only have grown since they were mapped.
+	struct valid lines = empty;
+	for (size_t i = 0; fresh && i < files->count; i++) {
+		const struct ethers_file *_Nonnull const file = &files->file[i];
+		struct stat                              fd_stat;
+		struct stat                              path_stat;
+		const off_t                              mapped = is_empty(file->map) ? 0 : (off_t)(file->map.end - file->map.start);
+		if (i == files->writable) {
+			continue;
+		} else if (file->fd < 0) {
+			fresh = stat(file->path, &path_stat) != 0;
+		} else if (fstat(file->fd, &fd_stat) != 0) {
+			xo_err(EX_IOERR, "Failed to fstat() ethers file '%s'", file->path);
+		} else if ((fresh = stat(file->path, &path_stat) == 0 && fd_stat.st_dev == path_stat.st_dev &&
+		                    fd_stat.st_ino == path_stat.st_ino && fd_stat.st_size >= mapped)) {
+			lines = ethers_concat(writer->arena, lines, ethers_read_lines(writer->arena, file, mapped, fd_stat.st_size));
+		}
+	}
+	if (!fresh) {
+		xo_errx(EX_TEMPFAIL, "The ethers directory '%s' has been modified concurrently, retry.", dir_path);
+	}
+	return lines;
+}
+
+// Lock the append lock file next to the ethers(5) file.
+// Returns the lock to release once the new lines have been appended.
+static int
+ethers_append_lock(const struct ethers_file file[const static 1], uint64_t lock_wait[const static 1])
+{
+	const char *_Nonnull const path = file->path;
+	const size_t               size = strlen(path) + 1;
+	char                       dir_copy[PATH_MAX];
+	char                       base_copy[PATH_MAX];
+	char                       lock_path[PATH_MAX];
+
+	memcpy(dir_copy, path, size);
+	memcpy(base_copy, path, size);
+	const int length = snprintf(lock_path, sizeof(lock_path), "%s/.%s" ETHERS_APPEND_SUFFIX, dirname(dir_copy), basename(base_copy));
+	if (length < 0 || length >= PATH_MAX) {
+		xo_errx(EX_CONFIG, "The append lock path for ethers file '%s' is too long", path);
+	}
+	const int lock_fd = open(lock_path, O_RDONLY | O_CREAT | O_CLOEXEC, 0644);
+	if (lock_fd < 0) {
+		xo_err(EX_CANTCREAT, "Failed to open append lock file '%s'", lock_path);
+	} else if (!ethers_flock(lock_fd, lock_wait)) {
+		xo_err(EX_IOERR, "Failed to lock ethers(5) file for appending: %s", path);
+	}
+	return lock_fd;
+}
+
+// Read the complete lines appended after the first <seen> bytes of the locked file into the arena.
+static struct valid
+ethers_writer_tail(struct ethers_writer writer[const static 1])
 {
+	const struct valid lines = ethers_read_lines(writer->arena, writer->file, writer->seen, writer->locked_size);
+	writer->seen += (off_t)valid_length(lines);
+	return lines;
+}
+
+// Lock the file for appending and return the complete lines other writers appended since the writer last looked.
+// Leased lines are appended under the shared lock held since opening the file, which keeps compactions out,
+// and only serialize on the append lock. Other writers upgrade to the exclusive lock, giving up the append lock first:
+// waiting for the exclusive lock while holding it would deadlock with leased writers waiting for it under the shared lock.
+// Upgrading isn't atomic either, so callers replay the returned lines and lock again until no lines are returned before flushing.
+struct valid
+ethers_writer_lock(struct ethers_writer writer[const static 1])
+{
+	const struct ethers_file *_Nonnull const file   = writer->file;
+	struct valid                             shards = empty;
+	if (writer->leased && !writer->locked) {
+		ethers_file_check(file);
+		writer->lock_fd = ethers_append_lock(file, &writer->lock_wait);
+	} else if (!writer->leased && !writer->exclusive) {
+		if (writer->lock_fd >= 0 && close(writer->lock_fd) != 0) {
+			xo_err(EX_IOERR, "Failed to unlock ethers(5) file: %s", file->path);
+		}
+		writer->lock_fd    = -1;
+		writer->lock_wait += ethers_file_lock(file);
+		writer->exclusive  = true;
+
+		// The shard lock is taken first: writers waiting for the directory lock already hold their shard's exclusive lock.
+		if (writer->shards != NULL && writer->shards->paths != NULL) {
+			shards = ethers_files_lock(writer);
+		}
+	}
+	writer->locked = true;
+
 	struct stat stat_buffer;
-	FILE *const stream = writer->stream;
+	if (fstat(file->fd, &stat_buffer) != 0) {
+		xo_err(EX_IOERR, "Failed to fstat() ethers file '%s'", file->path);
+	}
+	writer->locked_size = stat_buffer.st_size;
+	return ethers_concat(writer->arena, shards, ethers_writer_tail(writer));
+}
+
+ssize_t
+ethers_writer_flush(struct ethers_writer writer[const static 1])
+{
 	const int fd = writer->file->fd;
-	const char *_Nonnull const ethers_path = writer->file->args->ethers_path;
-	if (fflush(stream) != 0) {
-		xo_err(EX_OSERR, "Failed to flush memory stream");
-	} else if (flock(fd, LOCK_EX) != 0) {
-		xo_err(EX_IOERR, "Failed to lock ethers(5) file for writing: %s", ethers_path);
-	} else if (fstat(fd, &stat_buffer) != 0) {
-		xo_err(EX_IOERR, "Failed to fstat() ethers file '%s'", ethers_path);
+	const char *_Nonnull const ethers_path = writer->file->path;
+	if (writer->size != 0 && is_snapshot(&writer->file->snapshot)) {
+		xo_errx(EX_DATAERR, "The ethers(5) file '%s' is a read-only binary snapshot.", ethers_path);
+	}
+	// Writers not replaying the lines appended meanwhile (e.g. of release records) only lock the file here.
+	if (!writer->locked) {
+		(void)ethers_writer_lock(writer);
 	}
 
-	const char *_Nullable const buffer  = writer->buffer->buffer;
-	const size_t                size    = writer->buffer->size;
-	const ssize_t               written = write(fd, buffer, size);
+	const char *_Nullable const buffer  = writer->buffer;
+	const size_t                size    = writer->size;
+	const ssize_t               written = size == 0 ? 0 : write(fd, buffer, size);
 	if (written < 0) {
 		return written;
 	} else if (size != (size_t)written) {
-		if (ftruncate(fd, stat_buffer.st_size) != 0) {
+		// Every other writer appending to the file waits for the lock held meanwhile.
+		if (ftruncate(fd, writer->locked_size) != 0) {
 			xo_err(EX_IOERR, "Failed to ftruncate() away partial write to ethers(5) file: %s", ethers_path);
 		}
 		errno = EIO;
 		return -1;
-	} else if (flock(fd, LOCK_SH) != 0) {
+	} else if (writer->lock_fd >= 0 && close(writer->lock_fd) != 0) {
+		xo_err(EX_IOERR, "Failed to unlock ethers(5) file: %s", ethers_path);
+	} else if (writer->exclusive && flock(fd, LOCK_SH) != 0) {
 		xo_err(EX_IOERR, "Failed to downgrade ethers(5) file lock: %s", ethers_path);
 	}
-	ethers_buffer_free(writer->buffer);
+	writer->seen      = writer->locked_size + written;
+	writer->lock_fd   = -1;
+	writer->locked    = false;
+	writer->exclusive = false;
+	writer->size      = 0;
 	return written;
 }
 
-void
-ethers_writer_close(struct ethers_writer writer[const static 1])
-{
-	if (fclose(writer->stream) != 0) {
-		xo_err(EX_OSERR, "Failed to close memory stream");
-	}
-	ethers_buffer_free(writer->buffer);
-}
-
-
 #pragma clang diagnostic pop
 
@@ -5,9 +5,15 @@
 
 #include <sys/param.h>
 #include <net/ethernet.h>
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
+#include "arena.h"
+#include "ethers_line.h"
 #include "scan.h"
+#include "snapshot.h"
 #include "cli_args.h"
 
 #if __STDC_VERSION__ >= 202311L
@@ -39,42 +45,142 @@ static_assert(true); // Workaround for https://github.com/clangd/clangd/issues/1
 
 struct ethers_file {
 	const struct cli_args *_Nonnull const args;
+	const char            *_Nonnull const path;
 	const struct valid                    map;
+	const struct snapshot                 snapshot;
 	const int                             fd;
 	const int                             reserved;
 };
 
+// A single ethers file or the shards of an ethers directory in lexical order.
+// New mappings are appended to the writable shard.
+struct ethers_files {
+	struct ethers_file *_Nonnull const           file;
+	char               (*_Nullable const paths)[PATH_MAX];
+	const size_t                                 count;
+	const size_t                                 writable;
+};
+
+// A lease reserves <count> consecutive addresses starting at the record's MAC address
+// for the owner named by the record until <expires> (seconds since the epoch):
+//
+//     # lease <MAC address> <count> <owner> <expires>
+//
+// A later lease record of the same owner and first address replaces it (expires 0 returns it).
+struct ethers_lease {
+	uint64_t count;
+	uint64_t expires;
+};
+
+// Lease records are skipped unless the reader asks for them.
+// Quiet readers only record why reading failed (ETHERS_LINE_*) instead of warning
+// (e.g. on threads without the caller's libxo(3) handle).
+// The hostname of the last mapping read is also sliced out of the input (without copying or a NUL terminator).
 struct ethers_reader {
 	const struct ethers_file *_Nonnull const file;
 	struct valid                             input;
 	size_t                                   line_number;
+	bool                                     leases;
+	bool                                     quiet;
+	int                                      error;
+	struct valid                             name;
+	struct ethers_lease                      lease;
 };
 
-struct ethers_buffer {
-	char   *_Nullable buffer;
-	size_t            size;
-};
-
+// New lines are buffered in the arena until they're appended with a single write(2).
+// Lines only mapping addresses leased to the writer (or claimed from the shared bitmap)
+// can't collide with other writers' addresses and are appended without upgrading to the exclusive lock.
+// Leased writers serialize their appends on the append lock instead (see ETHERS_APPEND_SUFFIX).
+// Allocations from the shards of a directory also lock the directory (see ETHERS_LOCK_FILE).
+// The file is read up to <seen> bytes, the lines appended after that are returned by ethers_writer_lock().
 struct ethers_writer {
 	const struct ethers_file *_Nonnull const file;
-	FILE                     *_Nonnull const stream;
-	struct ethers_buffer     *_Nonnull const buffer;
+	struct arena             *_Nonnull const arena;
+	const struct ethers_files *_Nullable     shards;
+	char                     *_Nullable      buffer;
+	size_t                                   size;
+	size_t                                   capacity;
+	uint64_t                                 lock_wait;
+	off_t                                    seen;
+	off_t                                    locked_size;
+	int                                      lock_fd;
+	bool                                     locked;
+	bool                                     exclusive;
+	bool                                     leased;
+};
+
+// Compaction records the sorted lines following its header comment:
+//
+//     # sorted <key> <length>
+//
+// The <length> bytes after the header are complete lines sorted by <key> (name or address).
+// Lines appended later form the unsorted tail.
+struct ethers_sorted {
+	struct valid lines;
+	struct valid tail;
+	bool         by_name;
 };
 
-struct ethers_file   ethers_file_open(const struct cli_args args[const static 1]);
+#define ETHERS_SORTED_MARKER "sorted"
+
+// A replacement of a <kind> of file (e.g. "ethers file") written to a temporary file in the same directory
+// and renamed over the file once it's complete, so readers mapping it never see a partial file.
+struct ethers_replace {
+	FILE       *_Nonnull stream;
+	const char *_Nonnull path;
+	const char *_Nonnull kind;
+	size_t               base_offset;
+	int                  dir_fd;
+	char                 base_path[PATH_MAX];
+	char                 temp_path[PATH_MAX];
+};
+
+// Writers allocating new mappings in a shard serialize on this file in the ethers directory
+// (skipped as a shard because it starts with a dot).
+#define ETHERS_LOCK_FILE ".lock"
+
+// Leased writers of ethers/local serialize their appends on ethers/.local.append (ignored as a shard).
+#define ETHERS_APPEND_SUFFIX ".append"
+
+// Kinds of records returned by ethers_reader_read().
+#define ETHERS_ENTRY          1
+#define ETHERS_RELEASE        2
+#define ETHERS_LEASE          3
+
+// Results of ethers_bisect().
+#define ETHERS_BISECT_UNSORTED (-1)
+#define ETHERS_BISECT_MISSING  0
+#define ETHERS_BISECT_FOUND    1
+
+struct ethers_file   ethers_file_open(const struct cli_args args[const static 1], const char path[const static 1]);
+struct ethers_file   ethers_file_reopen(const struct cli_args args[const static 1], const char path[const static 1]);
 void                 ethers_file_close(const struct ethers_file file);
 void                 ethers_file_cleanup(const struct ethers_file file[const static 1]);
+struct ethers_files  ethers_files_open(const struct cli_args args[const static 1]);
+void                 ethers_files_close(const struct ethers_files files);
+void                 ethers_files_cleanup(const struct ethers_files files[const static 1]);
+uint64_t             ethers_file_lock(const struct ethers_file file[const static 1]);
+struct valid         ethers_mmap(int fd, const char path[static const 1]);
+void                 ethers_unmap(struct valid map);
+struct ethers_sorted ethers_sorted(const struct ethers_file file[const static 1]);
+int                  ethers_bisect(const struct ethers_file file[const static 1], struct valid lines, const char name[const static 1], struct ether_addr addr[const static 1]);
+ssize_t              ethers_print(FILE *_Nonnull stream, const struct ether_addr addr[const static 1], struct valid name);
+struct ethers_replace ethers_replace_open(const char path[const static 1], const char kind[const static 1], mode_t mode);
+void                 ethers_replace_commit(struct ethers_replace replace[const static 1], bool failed);
+ssize_t              ethers_print_lease(FILE *_Nonnull stream, const struct ether_addr addr[const static 1], const char owner[const static 1],
+                                        struct ethers_lease lease);
 
 struct ethers_reader ethers_reader_create(const struct ethers_file *_Nonnull const file);
+void                 ethers_reader_warn(const struct ethers_file file[const static 1], int error, size_t line_number);
 ssize_t              ethers_reader_read(struct ethers_reader reader[const static 1], struct ether_addr addr[const static 1], char name[const static MAXHOSTNAMELEN]);
 
-#define ETHERS_BUFFER_INIT ((struct ethers_buffer) { .buffer = NULL, .size = 0 })
-void                 ethers_buffer_free(struct ethers_buffer[static const 1]);
-
-struct ethers_writer ethers_writer_create(const struct ethers_file *_Nonnull const file, struct ethers_buffer buffer[const static 1]);
+struct ethers_writer ethers_writer_create(const struct ethers_file *_Nonnull const file, struct arena arena[const static 1]);
 ssize_t              ethers_writer_write(struct ethers_writer writer[const static 1], const struct ether_addr[const static 1], const char name[const static 1]);
+ssize_t              ethers_writer_release(struct ethers_writer writer[const static 1], const struct ether_addr[const static 1], const char name[const static 1]);
+ssize_t              ethers_writer_lease(struct ethers_writer writer[const static 1], const struct ether_addr[const static 1], const char owner[const static 1],
+                                         struct ethers_lease lease);
+struct valid         ethers_writer_lock(struct ethers_writer writer[const static 1]);
 ssize_t              ethers_writer_flush(struct ethers_writer writer[const static 1]);
-void                 ethers_writer_close(struct ethers_writer writer[const static 1]);
 
 #pragma clang diagnostic pop
 #endif /* ETHERS_FILE_H */
@@ -0,0 +1,90 @@
+// vim: ft=c:ts=8 :
+
+// The record parsing shared by ethers(1) and the nss(5) module.
+// Neither libxo(3) nor anything else of ethers(1) may be used here.
+
+// Include system headers from subdirectories.
+#include <net/ethernet.h>
+#include <sys/param.h>
+
+// Include system headers
+#include <string.h>
+
+#include "ethers_line.h"
+#include "scan.h"
+#include "slice.h"
+
+#if __STDC_VERSION__ >= 202311L
+static_assert(true); // Workaround for https://github.com/clangd/clangd/issues/1167
+#endif 
+
+#pragma clang diagnostic push
+
+// Set *very* aggressive diagnostics specific to clang (version 19.1.3).
+// These diagnostics aren't stable between compiler versions.
+// If used like this they're **EXPECTED** to break break the build,
+// but they're also useful for catching errors.
+// Use `make debug` to build with these diagnostics.
+#ifdef RACONIC
+#pragma clang diagnostic error   "-Weverything"
+#pragma clang diagnostic ignored "-Wunsafe-buffer-usage"
+#pragma clang diagnostic ignored "-Wdeclaration-after-statement"
+#pragma clang diagnostic ignored "-Wpre-c11-compat"
+#pragma clang diagnostic ignored "-Wpre-c23-compat"
+#pragma clang diagnostic ignored "-Wc2y-extensions"
+#pragma clang diagnostic ignored "-Wc++98-compat"
+#pragma clang diagnostic ignored "-Wnullability-extension"
+#pragma clang diagnostic ignored "-Wvla"
+#pragma clang diagnostic ignored "-Wgnu-statement-expression"
+#pragma clang diagnostic ignored "-Wgnu-conditional-omitted-operand"
+#pragma clang diagnostic ignored "-Wgnu-case-range"
+#pragma clang diagnostic ignored "-Wgnu-designator"
+#endif
+
+// Returns the fields after the marker or none if the comment isn't such a record.
+struct maybe
+ethers_line_marker(const struct maybe comment, const char marker[const static 1])
+{
+	if (is_null(comment)) {
+		return none;
+	}
+	const struct valid fields = trim_left_whitespace(or_empty(comment));
+	const size_t       length = strlen(marker);
+	if (valid_length(fields) <= length || memcmp(fields.start, marker, length) != 0) {
+		return none;
+	} else if (fields.start[length] != ' ' && fields.start[length] != '\t') {
+		return none;
+	}
+	return MAYBE(&fields.start[length], fields.end);
+}
+
+// Parse the fields of a mapping: a MAC address and a hostname separated by whitespace and nothing else.
+// The hostname points into the fields.
+int
+ethers_line_mapping(const struct valid fields, struct ether_addr addr[const static 1], struct maybe name[const static 1])
+{
+	// Extract MAC address out of the 1st field on the line.
+	struct maybe space = scan_addr(fields, addr);
+	if (is_null(space)) {
+		return ETHERS_LINE_ADDR;
+	}
+
+	// The MAC address and hostname must be separated by at least one whitespace.
+	const struct valid field = trim_left_whitespace(or_empty(space));
+	if (field.start == space.start) {
+		return ETHERS_LINE_WHITESPACE;
+	}
+
+	// Locate the hostname (2nd field) on the line and prohibit further fields.
+	space = scan_name(field, name);
+	if (is_null(space)) {
+		return ETHERS_LINE_NAME;
+	} else if ((size_t)(name->end - name->start) >= MAXHOSTNAMELEN) {
+		return ETHERS_LINE_LONG_NAME;
+	} else if (!is_empty(trim_left_whitespace(or_empty(space)))) {
+		return ETHERS_LINE_FIELDS;
+	}
+	return ETHERS_LINE_VALID;
+}
+
+#pragma clang diagnostic pop
@@ -0,0 +1,57 @@
+// vim: ft=c:ts=8 :
+
+#ifndef ETHERS_LINE_H
+#define ETHERS_LINE_H
+
+#include <net/ethernet.h>
+
+#include "scan.h"
+#include "slice.h"
+
+#if __STDC_VERSION__ >= 202311L
+static_assert(true); // Workaround for https://github.com/clangd/clangd/issues/1167
+#endif
+
+#pragma clang diagnostic push
+
+// Set *very* aggressive diagnostics specific to clang (version 19.1.3).
+// These diagnostics aren't stable between compiler versions.
+// If used like this they're **EXPECTED** to break break the build,
+// but they're also useful for catching errors.
+// Use `make debug` to build with these diagnostics.
+#ifdef RACONIC
+#pragma clang diagnostic error   "-Weverything"
+#pragma clang diagnostic ignored "-Wunsafe-buffer-usage"
+#pragma clang diagnostic ignored "-Wdeclaration-after-statement"
+#pragma clang diagnostic ignored "-Wpre-c11-compat"
+#pragma clang diagnostic ignored "-Wpre-c23-compat"
+#pragma clang diagnostic ignored "-Wc2y-extensions"
+#pragma clang diagnostic ignored "-Wc++98-compat"
+#pragma clang diagnostic ignored "-Wnullability-extension"
+#pragma clang diagnostic ignored "-Wvla"
+#pragma clang diagnostic ignored "-Wgnu-statement-expression"
+#pragma clang diagnostic ignored "-Wgnu-conditional-omitted-operand"
+#pragma clang diagnostic ignored "-Wgnu-case-range"
+#pragma clang diagnostic ignored "-Wgnu-designator"
+#endif
+
+// Release records (tombstones) and lease records are comments to other ethers(5) parsers:
+//
+//     # release <MAC address> <hostname>
+//     # lease <MAC address> <count> <owner> <expires>
+#define ETHERS_RELEASE_MARKER "release"
+#define ETHERS_LEASE_MARKER   "lease"
+
+// Results of ethers_line_mapping(): either a valid mapping or the reason the fields aren't one.
+#define ETHERS_LINE_VALID      0
+#define ETHERS_LINE_ADDR       1
+#define ETHERS_LINE_WHITESPACE 2
+#define ETHERS_LINE_NAME       3
+#define ETHERS_LINE_LONG_NAME  4
+#define ETHERS_LINE_FIELDS     5
+
+struct maybe ethers_line_marker(struct maybe comment, const char marker[const static 1]);
+int          ethers_line_mapping(struct valid fields, struct ether_addr addr[const static 1], struct maybe name[const static 1]);
+
+#pragma clang diagnostic pop
+#endif /* ETHERS_LINE_H */
@@ -0,0 +1,262 @@
+// vim: ft=c:ts=8 :
+
+#include "follow.h"
+#include "ethers_file.h"
+
+// Include library headers
+#include <libxo/xo.h>
+
+// Include system headers from subdirectories.
+#if defined(__linux__)
+#include <sys/inotify.h>
+#else
+#include <sys/event.h>
+#endif
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// Include system headers
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#if __STDC_VERSION__ >= 202311L
+static_assert(true); // Workaround for https://github.com/clangd/clangd/issues/1167
+#endif 
+
+#pragma clang diagnostic push
+
+// Set *very* aggressive diagnostics specific to clang (version 19.1.3).
+// These diagnostics aren't stable between compiler versions.
+// If used like this they're **EXPECTED** to break break the build,
+// but they're also useful for catching errors.
+// Use `make debug` to build with these diagnostics.
+#ifdef RACONIC
+#pragma clang diagnostic error   "-Weverything"
+#pragma clang diagnostic ignored "-Wunsafe-buffer-usage"
+#pragma clang diagnostic ignored "-Wdeclaration-after-statement"
+#pragma clang diagnostic ignored "-Wpre-c11-compat"
+#pragma clang diagnostic ignored "-Wpre-c23-compat"
+#pragma clang diagnostic ignored "-Wc2y-extensions"
+#pragma clang diagnostic ignored "-Wc++98-compat"
+#pragma clang diagnostic ignored "-Wnullability-extension"
+#pragma clang diagnostic ignored "-Wvla"
+#pragma clang diagnostic ignored "-Wgnu-statement-expression"
+#pragma clang diagnostic ignored "-Wgnu-conditional-omitted-operand"
+#pragma clang diagnostic ignored "-Wgnu-case-range"
+#pragma clang diagnostic ignored "-Wgnu-designator"
+#endif
+
+#if defined(__linux__)
+static int
+queue_create(const struct ethers_file file[const static 1])
+{
+	const char *_Nonnull const path = file->path;
+	const int queue = inotify_init1(IN_CLOEXEC);
+	if (queue < 0) {
+		xo_err(EX_OSERR, "Failed to create inotify descriptor");
+	}
+	const uint32_t mask = IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF;
+	if (inotify_add_watch(queue, path, mask) < 0) {
+		xo_err(EX_OSERR, "Failed to watch ethers file '%s'", path);
+	}
+	return queue;
+}
+
+// Watch a directory for new entries (e.g. the followed file renamed back into place).
+static int
+queue_create_dir(const int dir_fd __attribute__((unused)), const char dir_path[const static 1])
+{
+	const int queue = inotify_init1(IN_CLOEXEC);
+	if (queue < 0) {
+		xo_err(EX_OSERR, "Failed to create inotify descriptor");
+	} else if (inotify_add_watch(queue, dir_path, IN_CREATE | IN_MOVED_TO) < 0) {
+		xo_err(EX_OSERR, "Failed to watch directory '%s'", dir_path);
+	}
+	return queue;
+}
+
+static void
+queue_wait(const int queue)
+{
+	char events[sizeof(struct inotify_event) + NAME_MAX + 1] __attribute__((aligned(__alignof__(struct inotify_event))));
+	while (read(queue, events, sizeof(events)) < 0) {
+		if (errno != EINTR) {
+			xo_err(EX_OSERR, "Failed to wait for inotify events");
+		}
+	}
+}
+#else
+static int
+queue_create(const struct ethers_file file[const static 1])
+{
+	const char *_Nonnull const path = file->path;
+	const int queue = kqueue();
+	if (queue < 0) {
+		xo_err(EX_OSERR, "Failed to create kqueue");
+	}
+	struct kevent change;
+	const u_int   fflags = NOTE_WRITE | NOTE_EXTEND | NOTE_ATTRIB | NOTE_LINK | NOTE_DELETE | NOTE_RENAME | NOTE_REVOKE;
+	EV_SET(&change, file->fd, EVFILT_VNODE, EV_ADD | EV_CLEAR, fflags, 0, NULL);
+	if (kevent(queue, &change, 1, NULL, 0, NULL) < 0) {
+		xo_err(EX_OSERR, "Failed to watch ethers file '%s'", path);
+	}
+	return queue;
+}
+
+// Watch a directory for new entries (e.g. the followed file renamed back into place).
+static int
+queue_create_dir(const int dir_fd, const char dir_path[const static 1])
+{
+	const int queue = kqueue();
+	if (queue < 0) {
+		xo_err(EX_OSERR, "Failed to create kqueue");
+	}
+	struct kevent change;
+	EV_SET(&change, dir_fd, EVFILT_VNODE, EV_ADD | EV_CLEAR, NOTE_WRITE, 0, NULL);
+	if (kevent(queue, &change, 1, NULL, 0, NULL) < 0) {
+		xo_err(EX_OSERR, "Failed to watch directory '%s'", dir_path);
+	}
+	return queue;
+}
+
+static void
+queue_wait(const int queue)
+{
+	struct kevent event;
+	while (kevent(queue, NULL, 0, &event, 1, NULL) < 0) {
+		if (errno != EINTR) {
+			xo_err(EX_OSERR, "Failed to wait for kqueue events");
+		}
+	}
+}
+#endif
+
+// Followers don't write so they don't hold on to the shared lock keeping writers out.
+// Writers append complete lines with a single write(2) and only complete lines are parsed.
+struct follow
+follow_create(const struct ethers_file file[const static 1])
+{
+	if (flock(file->fd, LOCK_UN) != 0) {
+		xo_err(EX_IOERR, "Failed to unlock ethers file '%s'", file->path);
+	}
+	return (struct follow) {
+		.file        = file,
+		.queue       = queue_create(file),
+		.reserved    = 0,
+		.offset      = 0,
+		.line_number = 0,
+		.buffer      = NULL,
+		.size        = 0
+	};
+}
+
+void
+follow_cleanup(struct follow follow[const static 1])
+{
+	free(follow->buffer);
+	if (close(follow->queue) != 0) {
+		xo_err(EX_OSERR, "Failed to close() event queue");
+	}
+}
+
+// Wait until the path exists again after the followed file has been removed.
+// The directory is watched before checking for the path to not miss it being recreated in between.
+void
+follow_await(const char path[const static 1])
+{
+	char copy[PATH_MAX];
+	if (strlcpy(copy, path, sizeof(copy)) >= sizeof(copy)) {
+		xo_errx(EX_CONFIG, "The path of ethers file '%s' is too long", path);
+	}
+	const char *_Nonnull const dir_path = dirname(copy);
+	const int                  dir_fd   = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd < 0) {
+		xo_err(EX_NOINPUT, "Failed to open directory '%s'", dir_path);
+	}
+	const int queue = queue_create_dir(dir_fd, dir_path);
+
+	struct stat stat_buffer;
+	while (stat(path, &stat_buffer) != 0) {
+		if (errno != ENOENT) {
+			xo_err(EX_IOERR, "Failed to stat() ethers file '%s'", path);
+		}
+		queue_wait(queue);
+	}
+
+	if (close(queue) != 0) {
+		xo_err(EX_OSERR, "Failed to close() event queue");
+	} else if (close(dir_fd) != 0) {
+		xo_err(EX_OSERR, "Failed to close() directory '%s'", dir_path);
+	}
+}
+
+// Has the file been replaced (e.g. compacted) or truncated since it was opened?
+static bool
+follow_replaced(const struct follow follow[const static 1], const struct stat fd_stat[const static 1])
+{
+	struct stat path_stat;
+	const char *_Nonnull const path = follow->file->path;
+	if (stat(path, &path_stat) != 0) {
+		return errno == ENOENT;
+	}
+	return fd_stat->st_dev != path_stat.st_dev || fd_stat->st_ino != path_stat.st_ino || fd_stat->st_size < follow->offset;
+}
+
+// Wait for complete lines to be appended and return them with the number of lines before them.
+// Returns false once the followed file has been replaced.
+bool
+follow_next(struct follow follow[const static 1], struct valid lines[const static 1], size_t line_number[const static 1])
+{
+	const int                  fd   = follow->file->fd;
+	const char *_Nonnull const path = follow->file->path;
+
+	for (;; queue_wait(follow->queue)) {
+		struct stat fd_stat;
+		if (fstat(fd, &fd_stat) != 0) {
+			xo_err(EX_IOERR, "Failed to fstat() ethers file '%s'", path);
+		} else if (follow_replaced(follow, &fd_stat)) {
+			return false;
+		} else if (fd_stat.st_size == follow->offset) {
+			continue;
+		}
+
+		const size_t appended = (size_t)(fd_stat.st_size - follow->offset);
+		if (appended > follow->size) {
+			char *_Nullable const buffer = realloc(follow->buffer, appended);
+			if (buffer == NULL) {
+				xo_err(EX_OSERR, "Failed to allocate %zu byte buffer", appended);
+			}
+			follow->buffer = buffer;
+			follow->size   = appended;
+		}
+		char *_Nonnull const buffer = follow->buffer;
+		const ssize_t        length = pread(fd, buffer, appended, follow->offset);
+		if (length < 0) {
+			xo_err(EX_IOERR, "Failed to pread() ethers file '%s'", path);
+		}
+
+		// Leave an incomplete last line for later.
+		const char *_Nullable const end = memrchr(buffer, '\n', (size_t)length);
+		if (end == NULL) {
+			continue;
+		}
+		*lines       = VALID(buffer, &end[1]);
+		*line_number = follow->line_number;
+
+		follow->offset += (off_t)valid_length(*lines);
+		for (const char *_Nonnull line = buffer; line != lines->end; line++) {
+			follow->line_number += *line == '\n';
+		}
+		return true;
+	}
+}
+
+#pragma clang diagnostic pop
@@ -0,0 +1,56 @@
+// vim: ft=c:ts=8 :
+
+#ifndef FOLLOW_H
+#define FOLLOW_H
+
+#include <sys/types.h>
+#include <stdbool.h>
+
+#include "ethers_file.h"
+
+#if __STDC_VERSION__ >= 202311L
+static_assert(true); // Workaround for https://github.com/clangd/clangd/issues/1167
+#endif 
+
+#pragma clang diagnostic push
+
+// Set *very* aggressive diagnostics specific to clang (version 19.1.3).
+// These diagnostics aren't stable between compiler versions.
+// If used like this they're **EXPECTED** to break break the build,
+// but they're also useful for catching errors.
+// Use `make debug` to build with these diagnostics.
+#ifdef RACONIC
+#pragma clang diagnostic error   "-Weverything"
+#pragma clang diagnostic ignored "-Wunsafe-buffer-usage"
+#pragma clang diagnostic ignored "-Wdeclaration-after-statement"
+#pragma clang diagnostic ignored "-Wpre-c11-compat"
+#pragma clang diagnostic ignored "-Wpre-c23-compat"
+#pragma clang diagnostic ignored "-Wc2y-extensions"
+#pragma clang diagnostic ignored "-Wc++98-compat"
+#pragma clang diagnostic ignored "-Wnullability-extension"
+#pragma clang diagnostic ignored "-Wvla"
+#pragma clang diagnostic ignored "-Wgnu-statement-expression"
+#pragma clang diagnostic ignored "-Wgnu-conditional-omitted-operand"
+#pragma clang diagnostic ignored "-Wgnu-case-range"
+#pragma clang diagnostic ignored "-Wgnu-designator"
+#endif
+
+// Follow the lines appended to an ethers file.
+// The queue is a kqueue(2) on FreeBSD and an inotify(7) descriptor on Linux.
+struct follow {
+	const struct ethers_file *_Nonnull const file;
+	const int                                queue;
+	const int                                reserved;
+	off_t                                    offset;
+	size_t                                   line_number;
+	char                     *_Nullable      buffer;
+	size_t                                   size;
+};
+
+struct follow follow_create(const struct ethers_file file[const static 1]);
+void          follow_cleanup(struct follow follow[const static 1]);
+void          follow_await(const char path[const static 1]);
+bool          follow_next(struct follow follow[const static 1], struct valid lines[const static 1], size_t line_number[const static 1]);
+
+#pragma clang diagnostic pop
+#endif /* FOLLOW_H */
@@ -0,0 +1,76 @@
+// vim: ft=c:ts=8 :
+
+#include "arena.h"
+#include "ethers_file.h"
+#include "lease.h"
+
+// Include system headers from subdirectories.
+#include <net/ethernet.h>
+
+// Include system headers
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#if __STDC_VERSION__ >= 202311L
+static_assert(true); // Workaround for https://github.com/clangd/clangd/issues/1167
+#endif 
+
+#pragma clang diagnostic push
+
+// Set *very* aggressive diagnostics specific to clang (version 19.1.3).
+// These diagnostics aren't stable between compiler versions.
+// If used like this they're **EXPECTED** to break break the build,
+// but they're also useful for catching errors.
+// Use `make debug` to build with these diagnostics.
+#ifdef RACONIC
+#pragma clang diagnostic error   "-Weverything"
+#pragma clang diagnostic ignored "-Wunsafe-buffer-usage"
+#pragma clang diagnostic ignored "-Wdeclaration-after-statement"
+#pragma clang diagnostic ignored "-Wpre-c11-compat"
+#pragma clang diagnostic ignored "-Wpre-c23-compat"
+#pragma clang diagnostic ignored "-Wc2y-extensions"
+#pragma clang diagnostic ignored "-Wc++98-compat"
+#pragma clang diagnostic ignored "-Wnullability-extension"
+#pragma clang diagnostic ignored "-Wvla"
+#pragma clang diagnostic ignored "-Wgnu-statement-expression"
+#pragma clang diagnostic ignored "-Wgnu-conditional-omitted-operand"
+#pragma clang diagnostic ignored "-Wgnu-case-range"
+#pragma clang diagnostic ignored "-Wgnu-designator"
+#endif
+
+// Add a lease record replacing the earlier record of the same owner and first address (if any).
+// Leases are rare compared to mappings so a linear search is good enough.
+void
+leases_add(struct leases leases[const static 1], const struct ether_addr first[const static 1], const char owner[const static 1],
+           const struct ethers_lease lease)
+{
+	for (size_t i = leases->count; i-- > 0;) {
+		struct lease *_Nonnull const earlier = &leases->lease[i];
+		if (!memcmp(&earlier->first, first, sizeof(*first)) && !strcmp(earlier->owner, owner)) {
+			earlier->count   = lease.count;
+			earlier->expires = lease.expires;
+			return;
+		}
+	}
+
+	if (leases->count == leases->capacity) {
+		const size_t capacity = leases->capacity == 0 ? 16 : 2 * leases->capacity;
+		leases->lease    = arena_grow(leases->arena, leases->lease, leases->count, capacity, sizeof(struct lease));
+		leases->capacity = capacity;
+	}
+	struct lease *_Nonnull const added = &leases->lease[leases->count++];
+	added->first   = *first;
+	added->count   = lease.count;
+	added->expires = lease.expires;
+	strlcpy(added->owner, owner, sizeof(added->owner));
+}
+
+// The owner allocates from its own leases while they have more than the margin left.
+bool
+lease_usable(const struct lease lease[const static 1], const char *_Nullable const owner, const uint64_t now)
+{
+	return owner != NULL && !strcmp(lease->owner, owner) && lease->expires > now + LEASE_MARGIN;
+}
+
+#pragma clang diagnostic pop
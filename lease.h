@@ -0,0 +1,79 @@
+// vim: ft=c:ts=8 :
+
+#ifndef LEASE_H
+#define LEASE_H
+
+#include <sys/param.h>
+#include <net/ethernet.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "ethers_file.h"
+
+#if __STDC_VERSION__ >= 202311L
+static_assert(true); // Workaround for https://github.com/clangd/clangd/issues/1167
+#endif 
+
+#pragma clang diagnostic push
+
+// Set *very* aggressive diagnostics specific to clang (version 19.1.3).
+// These diagnostics aren't stable between compiler versions.
+// If used like this they're **EXPECTED** to break break the build,
+// but they're also useful for catching errors.
+// Use `make debug` to build with these diagnostics.
+#ifdef RACONIC
+#pragma clang diagnostic error   "-Weverything"
+#pragma clang diagnostic ignored "-Wunsafe-buffer-usage"
+#pragma clang diagnostic ignored "-Wdeclaration-after-statement"
+#pragma clang diagnostic ignored "-Wpre-c11-compat"
+#pragma clang diagnostic ignored "-Wpre-c23-compat"
+#pragma clang diagnostic ignored "-Wc2y-extensions"
+#pragma clang diagnostic ignored "-Wc++98-compat"
+#pragma clang diagnostic ignored "-Wnullability-extension"
+#pragma clang diagnostic ignored "-Wvla"
+#pragma clang diagnostic ignored "-Wgnu-statement-expression"
+#pragma clang diagnostic ignored "-Wgnu-conditional-omitted-operand"
+#pragma clang diagnostic ignored "-Wgnu-case-range"
+#pragma clang diagnostic ignored "-Wgnu-designator"
+#endif
+
+// Seconds a new lease lasts unless requested otherwise.
+#define LEASE_SECONDS 3600
+
+// Owners stop using a lease this many seconds before it expires
+// so no other writer allocates from it while its owner may still append to it.
+#define LEASE_MARGIN 60
+
+// The latest lease record of an owner and first address.
+struct lease {
+	struct ether_addr first;
+	uint64_t          count;
+	uint64_t          expires;
+	char              owner[MAXHOSTNAMELEN];
+};
+
+// The leases are allocated from the arena in the order they were first reserved.
+struct leases {
+	struct arena *_Nonnull  arena;
+	struct lease *_Nullable lease;
+	size_t                  count;
+	size_t                  capacity;
+};
+
+#define LEASES_INIT(arena_) ((struct leases) { .arena = (arena_), .lease = NULL, .count = 0, .capacity = 0 })
+
+// Other writers keep out of a lease until it expires.
+static inline bool
+lease_live(const struct lease lease[const static 1], const uint64_t now)
+{
+	return lease->expires > now;
+}
+
+void leases_add(struct leases leases[const static 1], const struct ether_addr first[const static 1], const char owner[const static 1],
+                struct ethers_lease lease);
+bool lease_usable(const struct lease lease[const static 1], const char *_Nullable owner, uint64_t now);
+
+#pragma clang diagnostic pop
+#endif /* LEASE_H */
@@ -0,0 +1,274 @@
+// vim: ft=c:ts=8 :
+
+#include "lookup.h"
+#include "allocator.h"
+#include "ethers_file.h"
+#include "lease.h"
+#include "pipeline.h"
+
+// Include library headers
+#include <libxo/xo.h>
+
+// Include system headers from subdirectories.
+#include <sys/param.h>
+
+// Include system headers
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#if __STDC_VERSION__ >= 202311L
+static_assert(true); // Workaround for https://github.com/clangd/clangd/issues/1167
+#endif 
+
+#pragma clang diagnostic push
+
+// Set *very* aggressive diagnostics specific to clang (version 19.1.3).
+// These diagnostics aren't stable between compiler versions.
+// If used like this they're **EXPECTED** to break break the build,
+// but they're also useful for catching errors.
+// Use `make debug` to build with these diagnostics.
+#ifdef RACONIC
+#pragma clang diagnostic error   "-Weverything"
+#pragma clang diagnostic ignored "-Wunsafe-buffer-usage"
+#pragma clang diagnostic ignored "-Wdeclaration-after-statement"
+#pragma clang diagnostic ignored "-Wpre-c11-compat"
+#pragma clang diagnostic ignored "-Wpre-c23-compat"
+#pragma clang diagnostic ignored "-Wc2y-extensions"
+#pragma clang diagnostic ignored "-Wc++98-compat"
+#pragma clang diagnostic ignored "-Wnullability-extension"
+#pragma clang diagnostic ignored "-Wvla"
+#pragma clang diagnostic ignored "-Wgnu-statement-expression"
+#pragma clang diagnostic ignored "-Wgnu-conditional-omitted-operand"
+#pragma clang diagnostic ignored "-Wgnu-case-range"
+#pragma clang diagnostic ignored "-Wgnu-designator"
+#endif
+
+struct request
+parse_request(const char name[const static 1])
+{
+	const char *_Nullable const slash = strchr(name, '/');
+	if (slash == NULL) {
+		return (struct request) { .name = name, .length = strlen(name), .order = 0, .block = false, .found = 0 };
+	}
+
+	char *_Nullable end = NULL;
+	errno = 0;
+	const unsigned long long count = strtoull(&slash[1], &end, 10);
+	if (slash == name || slash[1] < '0' || slash[1] > '9' || *end != '\0' || errno != 0) {
+		xo_errx(EX_USAGE, "Invalid block request '%s' (expected <name>/<count>).", name);
+	} else if (count == 0 || (count & (count - 1)) != 0 || count > (1ull << 47)) {
+		xo_errx(EX_USAGE, "The block size of '%s' must be a power of two (at most 2^47).", name);
+	}
+
+	return (struct request) {
+		.name   = name,
+		.length = (size_t)(slash - name),
+		.order  = (unsigned)__builtin_ctzll(count),
+		.block  = true,
+		.found  = 0
+	};
+}
+
+// Match a hostname read from the ethers(5) file against a requested name or block member.
+bool
+match_request(const struct request request[const static 1], const char name[const static 1])
+{
+	if (!request->block) {
+		return !strcmp(name, request->name);
+	} else if (strncmp(name, request->name, request->length) != 0 || name[request->length] != '-') {
+		return false;
+	}
+
+	// Block members are numbered in decimal without leading zeros.
+	const char *_Nonnull const digits = &name[request->length + 1];
+	if (digits[0] < '0' || digits[0] > '9' || (digits[0] == '0' && digits[1] != '\0')) {
+		return false;
+	}
+	uint64_t index = 0;
+	for (const char *_Nonnull digit = digits; *digit != '\0'; digit++) {
+		if (*digit < '0' || *digit > '9' || index >= (UINT64_C(1) << request->order)) {
+			return false;
+		}
+		index = index * 10 + (uint64_t)(*digit - '0');
+	}
+	return index < (UINT64_C(1) << request->order);
+}
+
+void
+mappings_add(struct mappings mappings[const static 1], const struct ether_addr addr[const static 1], const char name[const static 1], const bool release)
+{
+	if (mappings->count == mappings->capacity) {
+		const size_t capacity = mappings->capacity == 0 ? 16 : 2 * mappings->capacity;
+		mappings->mapping  = arena_grow(mappings->arena, mappings->mapping, mappings->count, capacity, sizeof(struct mapping));
+		mappings->capacity = capacity;
+	}
+	struct mapping *_Nonnull const mapping = &mappings->mapping[mappings->count++];
+	mapping->addr    = *addr;
+	mapping->release = release;
+	strlcpy(mapping->name, name, sizeof(mapping->name));
+}
+
+struct mapping *_Nullable
+mappings_find(const struct mappings mappings[const static 1], const char name[const static 1])
+{
+	for (size_t i = 0; i < mappings->count; i++) {
+		if (!strcmp(mappings->mapping[i].name, name)) {
+			return &mappings->mapping[i];
+		}
+	}
+	return NULL;
+}
+
+void
+mappings_remove(struct mappings mappings[const static 1], struct mapping mapping[const static 1])
+{
+	const size_t index = (size_t)(mapping - mappings->mapping);
+	memmove(mapping, &mapping[1], (mappings->count - index - 1) * sizeof(struct mapping));
+	mappings->count--;
+}
+
+// Record a mapping for the first request matching the hostname (unless the hostname is mapped already).
+// Returns true if a mapping was recorded.
+bool
+match_entry(struct mappings matches[const static 1], struct request requests[const static 1], const size_t count,
+            const struct ether_addr addr[const static 1], const char name[const static 1])
+{
+	for (size_t i = 0; i < count; i++) {
+		struct request *_Nonnull const request = &requests[i];
+		if (match_request(request, name)) {
+			if (mappings_find(matches, name) != NULL) {
+				return false;
+			}
+			mappings_add(matches, addr, name, false);
+			request->found++;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Drop the mapping of a release record from the matches.
+// Returns true if a mapping was dropped.
+bool
+match_release(struct mappings matches[const static 1], struct request requests[const static 1], const size_t count,
+              const struct ether_addr addr[const static 1], const char name[const static 1])
+{
+	struct mapping *_Nullable const mapping = mappings_find(matches, name);
+	if (mapping == NULL || memcmp(&mapping->addr, addr, sizeof(*addr)) != 0) {
+		return false;
+	}
+	mappings_remove(matches, mapping);
+	for (size_t i = 0; i < count; i++) {
+		struct request *_Nonnull const request = &requests[i];
+		if (match_request(request, name)) {
+			request->found--;
+			break;
+		}
+	}
+	return true;
+}
+
+void
+lookup_add(struct arena arena[const static 1], struct lookup lookup[const static 1], const uint64_t addr)
+{
+	if (lookup->count == lookup->capacity) {
+		const size_t capacity = lookup->capacity == 0 ? 1024 : 2 * lookup->capacity;
+		lookup->addrs    = arena_grow(arena, lookup->addrs, lookup->count, capacity, sizeof(uint64_t));
+		lookup->capacity = capacity;
+	}
+	lookup->addrs[lookup->count++] = addr;
+}
+
+// Claim the addresses of a batch and collect the records of the requested hostnames and the leases.
+static void
+lookup_batch(struct arena arena[const static 1], struct lookup lookup[const static 1], const struct batch batch[const static 1],
+             const struct request requests[const], const size_t count,
+             void (*_Nullable const print)(const struct ether_addr *_Nonnull, const char *_Nonnull, bool))
+{
+	for (size_t i = 0; i < batch->count; i++) {
+		const struct batch_entry *_Nonnull const entry   = &batch->entry[i];
+		const bool                               release = entry->kind == ETHERS_RELEASE;
+		if (entry->kind == ETHERS_LEASE) {
+			leases_add(&lookup->leases, &entry->addr, entry->name, entry->lease);
+			continue;
+		}
+		lookup_add(arena, lookup, addr_to_u64(entry->addr) | (release ? LOOKUP_RELEASE : 0));
+		for (size_t j = 0; j < count; j++) {
+			if (match_request(&requests[j], entry->name)) {
+				mappings_add(&lookup->records, &entry->addr, entry->name, release);
+				break;
+			}
+		}
+		if (print != NULL) {
+			print(&entry->addr, entry->name, release);
+		}
+	}
+}
+
+// Read all ethers files in a single pass collecting the claimed addresses
+// and the records of the requested hostnames per file.
+// The files are parsed by up to one thread per online CPU, each taking every <threads>th file in turn,
+// into batches consumed by the calling thread which also passes every record to print (if set) in file order.
+// Output stays on the calling thread because libxo(3) handles are thread-local.
+struct lookups
+lookup_files(struct arena arena[const static 1], const struct ethers_files files[const static 1],
+             const struct request requests[const], const size_t count,
+             void (*_Nullable const print)(const struct ether_addr *_Nonnull, const char *_Nonnull, bool))
+{
+	const long                      online    = sysconf(_SC_NPROCESSORS_ONLN);
+	const size_t                    threads   = MAX(MIN((size_t)MAX(online, 1), files->count), 1);
+	struct lookup   *_Nonnull const lookup    = arena_alloc(arena, files->count, sizeof(struct lookup));
+	struct pipeline *_Nonnull const pipelines = arena_alloc(arena, threads, sizeof(struct pipeline)); // Cache line aligned.
+	size_t          *_Nonnull const current   = arena_alloc(arena, threads, sizeof(size_t));
+	struct pipeline_waiter          waiter;
+	pipeline_waiter_init(&waiter);
+
+	for (size_t i = 0; i < files->count; i++) {
+		lookup[i] = (struct lookup) { .addrs = NULL, .count = 0, .capacity = 0, .records = MAPPINGS_INIT(arena), .leases = LEASES_INIT(arena) };
+	}
+	for (size_t i = 0; i < threads; i++) {
+		current[i] = i;
+		pipeline_start(&pipelines[i], &files->file[i], files->count - i, threads, arena, &waiter);
+	}
+
+	// Drain the pipelines in any order unless the records have to be printed in file order.
+	// Then only the pipeline parsing the first unfinished file is drained.
+	for (size_t done = 0; done < files->count;) {
+		const size_t first    = print != NULL ? done % threads : 0;
+		const size_t end      = print != NULL ? first + 1 : threads;
+		bool         progress = false;
+		for (size_t i = first; i < end; i++) {
+			const size_t                  file  = current[i];
+			struct batch *_Nullable const batch = file < files->count ? pipeline_poll(&pipelines[i]) : NULL;
+			if (batch == NULL) {
+				continue;
+			} else if (batch->error != ETHERS_LINE_VALID) {
+				ethers_reader_warn(&files->file[file], batch->error, batch->error_line);
+				xo_errx(EX_DATAERR, "Failed read in line %zu of ethers file '%s'.", batch->error_line, files->file[file].path);
+			}
+			lookup_batch(arena, &lookup[file], batch, requests, count, print);
+			if (batch->last) {
+				current[i] += threads;
+				done++;
+			}
+			pipeline_done(&pipelines[i], batch);
+			progress = true;
+		}
+		// Without progress no file finished, so one of the waited for pipelines is still parsing.
+		if (!progress) {
+			pipeline_wait(&waiter, &pipelines[first], end - first);
+		}
+	}
+
+	for (size_t i = 0; i < threads; i++) {
+		pipeline_join(&pipelines[i]);
+	}
+	pipeline_waiter_destroy(&waiter);
+
+	return (struct lookups) { .lookup = lookup, .count = files->count };
+}
+
+#pragma clang diagnostic pop
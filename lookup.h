@@ -0,0 +1,108 @@
+// vim: ft=c:ts=8 :
+
+#ifndef LOOKUP_H
+#define LOOKUP_H
+
+#include <sys/param.h>
+#include <net/ethernet.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "ethers_file.h"
+#include "lease.h"
+
+#if __STDC_VERSION__ >= 202311L
+static_assert(true); // Workaround for https://github.com/clangd/clangd/issues/1167
+#endif 
+
+#pragma clang diagnostic push
+
+// Set *very* aggressive diagnostics specific to clang (version 19.1.3).
+// These diagnostics aren't stable between compiler versions.
+// If used like this they're **EXPECTED** to break break the build,
+// but they're also useful for catching errors.
+// Use `make debug` to build with these diagnostics.
+#ifdef RACONIC
+#pragma clang diagnostic error   "-Weverything"
+#pragma clang diagnostic ignored "-Wunsafe-buffer-usage"
+#pragma clang diagnostic ignored "-Wdeclaration-after-statement"
+#pragma clang diagnostic ignored "-Wpre-c11-compat"
+#pragma clang diagnostic ignored "-Wpre-c23-compat"
+#pragma clang diagnostic ignored "-Wc2y-extensions"
+#pragma clang diagnostic ignored "-Wc++98-compat"
+#pragma clang diagnostic ignored "-Wnullability-extension"
+#pragma clang diagnostic ignored "-Wvla"
+#pragma clang diagnostic ignored "-Wgnu-statement-expression"
+#pragma clang diagnostic ignored "-Wgnu-conditional-omitted-operand"
+#pragma clang diagnostic ignored "-Wgnu-case-range"
+#pragma clang diagnostic ignored "-Wgnu-designator"
+#endif
+
+// A hostname argument of the form <name>/<count> requests a block of <count>
+// (a power of two) consecutive addresses named <name>-0 to <name>-<count - 1>.
+struct request {
+	const char *_Nonnull name;
+	size_t               length;
+	unsigned             order;
+	bool                 block;
+	uint64_t             found;
+};
+
+// The mappings matching the requested names in file order.
+// Matches only become final at the end of the file because
+// a later release record can still drop them.
+struct mapping {
+	struct ether_addr addr;
+	bool              release;
+	char              name[MAXHOSTNAMELEN];
+};
+
+struct mappings {
+	struct arena   *_Nonnull  arena;
+	struct mapping *_Nullable mapping;
+	size_t                    count;
+	size_t                    capacity;
+};
+
+#define MAPPINGS_INIT(arena_) ((struct mappings) { .arena = (arena_), .mapping = NULL, .count = 0, .capacity = 0 })
+
+// The result of reading one ethers file: every claimed address in file order
+// (packed into 48 bits, released addresses are tagged with LOOKUP_RELEASE),
+// the entries and release records of the requested hostnames and the leases.
+struct lookup {
+	uint64_t *_Nullable addrs;
+	size_t              count;
+	size_t              capacity;
+	struct mappings     records;
+	struct leases       leases;
+};
+
+// The lookups are allocated from the arena passed to lookup_files().
+struct lookups {
+	struct lookup *_Nonnull const lookup;
+	const size_t                  count;
+};
+
+#define LOOKUP_RELEASE (UINT64_C(1) << 63)
+
+struct request        parse_request(const char name[const static 1]);
+bool                  match_request(const struct request request[const static 1], const char name[const static 1]);
+
+void                  mappings_add(struct mappings mappings[const static 1], const struct ether_addr addr[const static 1], const char name[const static 1], bool release);
+struct mapping *_Nullable mappings_find(const struct mappings mappings[const static 1], const char name[const static 1]);
+void                  mappings_remove(struct mappings mappings[const static 1], struct mapping mapping[const static 1]);
+
+bool                  match_entry(struct mappings matches[const static 1], struct request requests[const static 1], size_t count,
+                                  const struct ether_addr addr[const static 1], const char name[const static 1]);
+bool                  match_release(struct mappings matches[const static 1], struct request requests[const static 1], size_t count,
+                                    const struct ether_addr addr[const static 1], const char name[const static 1]);
+
+void                  lookup_add(struct arena arena[const static 1], struct lookup lookup[const static 1], uint64_t addr);
+struct lookups        lookup_files(struct arena arena[const static 1], const struct ethers_files files[const static 1],
+                                   const struct request requests[const], size_t count,
+                                   void (*_Nullable print)(const struct ether_addr *_Nonnull, const char *_Nonnull, bool));
+
+#pragma clang diagnostic pop
+#endif /* LOOKUP_H */
@@ -12,18 +12,30 @@
 #include <sys/stat.h>
 
 // Include system headers
+#include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <libgen.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
 #include <stdbool.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "allocator.h"
+#include "arena.h"
 #include "cli_args.h"
+#include "compact.h"
 #include "ethers_file.h"
+#include "follow.h"
+#include "lease.h"
+#include "lookup.h"
+#include "name_index.h"
+#include "shared_allocator.h"
+#include "snapshot.h"
 
 #if __STDC_VERSION__ >= 202311L
 static_assert(true); // Workaround for https://github.com/clangd/clangd/issues/1167
@@ -56,7 +68,7 @@ static_assert(true); // Workaround for https://github.com/clangd/clangd/issues/1
 #define PROG_NAME   "ethers"
 
 static inline void
-print_entry(const struct ether_addr addr[static const 1], const char name[static const 1])
+print_entry(const struct ether_addr addr[static const 1], const char name[static const 1], const bool released)
 {
 	char buffer[sizeof("xx:xx:xx:xx:xx:xx")];
 	if (xo_open_marker("entry") < 0) {
@@ -65,7 +77,11 @@ print_entry(const struct ether_addr addr[static const 1], const char name[static
 	if (xo_open_instance("entries") < 0) {
 		xo_err(EX_IOERR, "Failed xo_open_instance(\"entries\")");
 	}
-	if (xo_emit("{P:  - }{L:Address}{D: = }{:address}{D:, }{L:Hostname}{D: = }{:hostname}\n", ether_ntoa_r(addr, buffer), name) < 0) {
+	if (xo_emit("{P:  - }{L:Address}{D: = }{:address}{D:, }{L:Hostname}{D: = }{:hostname}", ether_ntoa_r(addr, buffer), name) < 0) {
+		xo_err(EX_IOERR, "Failed to emit entry");
+	} else if (released && xo_emit("{D:, }{L:Released}{D: = }{:released}", "true") < 0) {
+		xo_err(EX_IOERR, "Failed to emit entry");
+	} else if (xo_emit("\n") < 0) {
 		xo_err(EX_IOERR, "Failed to emit entry");
 	}
 	if (xo_close_marker("entry") < 0) {
@@ -73,14 +89,9 @@ print_entry(const struct ether_addr addr[static const 1], const char name[static
 	}
 }
 
-static inline void
-print_entries(const struct ethers_file file[static const 1]) 
+static void
+open_dump(void)
 {
-	struct ethers_reader reader = ethers_reader_create(file);
-	ssize_t              delta;
-	struct ether_addr    addr[1];
-	char                 name[MAXHOSTNAMELEN];
-
 	if (xo_emit("{Lc:Entries}\n") < 0) {
 		xo_err(EX_IOERR, "Failed xo_emit()");
 	} else if (xo_open_marker("entries") < 0) {
@@ -88,17 +99,62 @@ print_entries(const struct ethers_file file[static const 1])
 	} else if (xo_open_list("entries") < 0) {
 		xo_err(EX_IOERR, "Failed xo_open_list(\"entries\")");
 	}
+}
 
-	for (delta = ethers_reader_read(&reader, addr, name); delta > 0; delta = ethers_reader_read(&reader, addr, name)) {
-		print_entry(addr, name);
+static void
+close_dump(void)
+{
+	if (xo_close_marker("entries") < 0) {
+		xo_err(EX_IOERR, "Failed xo_close_marker(\"entries\")");
 	}
+}
 
-	if (delta < 0) {
-		const char *_Nonnull const ethers_path = file->args->ethers_path;
-		xo_err(EX_DATAERR, "Failed to parse line %zu of ethers(5) file: %s", reader.line_number, ethers_path);
-	} else if (xo_close_marker("entries") < 0) {
-		xo_err(EX_IOERR, "Failed xo_close_marker(\"entries\")");
+static inline void
+print_entries(const struct ethers_files files[static const 1]) 
+{
+	open_dump();
+
+	for (size_t i = 0; i < files->count; i++) {
+		struct ethers_reader reader = ethers_reader_create(&files->file[i]);
+		ssize_t              delta;
+		struct ether_addr    addr[1];
+		char                 name[MAXHOSTNAMELEN];
+
+		for (delta = ethers_reader_read(&reader, addr, name); delta > 0; delta = ethers_reader_read(&reader, addr, name)) {
+			print_entry(addr, name, delta == ETHERS_RELEASE);
+		}
+		if (delta < 0) {
+			xo_err(EX_DATAERR, "Failed to parse line %zu of ethers(5) file: %s", reader.line_number, files->file[i].path);
+		}
+	}
+
+	close_dump();
+}
+
+// Parse the hostname arguments into requests allocated from the arena.
+static struct request *_Nonnull
+parse_requests(struct arena arena[const static 1], const char *_Nonnull const start[const], const size_t count)
+{
+	struct request *_Nonnull const requests = arena_alloc(arena, count, sizeof(struct request));
+	for (size_t i = 0; i < count; i++) {
+		requests[i] = parse_request(start[i]);
+	}
+	return requests;
+}
+
+// Read all files once dumping their entries on the way if verbose output is requested.
+static struct lookups
+lookup_entries(struct arena arena[const static 1], const struct ethers_files files[const static 1], const struct request requests[const], const size_t count)
+{
+	const bool verbose = files->file[0].args->verbose;
+	if (verbose) {
+		open_dump();
 	}
+	const struct lookups lookups = lookup_files(arena, files, requests, count, verbose ? print_entry : NULL);
+	if (verbose) {
+		close_dump();
+	}
+	return lookups;
 }
 
 static void
@@ -139,67 +195,826 @@ emit_entry(const struct ether_addr *_Nonnull const addr, const char *_Nonnull co
 	}
 }
 
+// The time spent waiting for the exclusive lock is only emitted in structured output (e.g. for load tests).
+static void
+emit_lock_wait(const struct ethers_writer writer[const static 1])
+{
+	if (xo_emit("{e:lock-wait-ns/%" PRIu64 "}", writer->lock_wait) < 0) {
+		xo_err(EX_IOERR, "Failed to emit lock wait time");
+	}
+}
+
+// Name and buffer every address of a newly allocated block.
+static void
+write_block(struct ethers_writer writer[const static 1], const struct request request[const static 1], const struct ether_addr first[const static 1])
+{
+	const uint64_t base = addr_to_u64(*first);
+	for (uint64_t index = 0; index < (UINT64_C(1) << request->order); index++) {
+		const struct ether_addr addr[1] = { u64_to_addr(base + index) };
+		char                    name[MAXHOSTNAMELEN];
+		const int length = snprintf(name, sizeof(name), "%.*s-%" PRIu64, (int)request->length, request->name, index);
+		if (length < 0 || (size_t)length >= sizeof(name)) {
+			xo_errx(EX_USAGE, "The block member names of '%s' are too long.", request->name);
+		}
+		emit_entry(addr, name);
+		if (ethers_writer_write(writer, addr, name) < 0) {
+			xo_err(EX_OSERR, "Failed to buffer new lines");
+		}
+	}
+}
+
+// Requests without a newly allocated address (MAC addresses only take 48 bits).
+#define UNALLOCATED UINT64_MAX
+
+// Emit and buffer the newly allocated addresses (the first address of each block).
+static void
+write_allocated(struct ethers_writer writer[const static 1], const struct request requests[const], const uint64_t allocated[const], const size_t count)
+{
+	for (size_t i = 0; i < count; i++) {
+		const struct request *_Nonnull const request = &requests[i];
+		const struct ether_addr              addr[1] = { u64_to_addr(allocated[i]) };
+		if (allocated[i] == UNALLOCATED) {
+			continue;
+		} else if (request->block) {
+			write_block(writer, request, addr);
+			continue;
+		}
+		emit_entry(addr, request->name);
+		if (ethers_writer_write(writer, addr, request->name) < 0) {
+			xo_err(EX_OSERR, "Failed to buffer new lines");
+		}
+	}
+}
+
+static void
+allocate_block(struct allocator allocator, const struct request request[const static 1], uint64_t allocated[const static 1])
+{
+	struct ether_addr first[1];
+	if (!allocator_alloc_block(allocator, request->order, first)) {
+		xo_errx(EX_UNAVAILABLE, "Failed to allocate MAC address block for hostname '%s'.", request->name);
+	}
+	*allocated = addr_to_u64(*first);
+}
+
+// Replay the records of every file in order into the matches.
+static void
+replay_lookups(const struct lookups lookups[const static 1], struct mappings matches[const static 1],
+               struct request requests[const], const size_t count)
+{
+	for (size_t i = 0; i < lookups->count; i++) {
+		const struct lookup *_Nonnull const lookup = &lookups->lookup[i];
+		for (size_t j = 0; j < lookup->records.count; j++) {
+			const struct mapping *_Nonnull const record = &lookup->records.mapping[j];
+			if (record->release) {
+				match_release(matches, requests, count, &record->addr, record->name);
+			} else {
+				match_entry(matches, requests, count, &record->addr, record->name);
+			}
+		}
+	}
+}
+
+// Replay the lines other writers appended since the files were read into the matches.
+// Collects the addresses they mapped and their leases into the claims if given.
+static void
+replay_tail(const struct ethers_file file[const static 1], const struct valid tail, struct mappings matches[const static 1],
+            struct request requests[const], const size_t count, struct lookup *_Nullable const claims)
+{
+	struct ethers_reader reader = ethers_reader_create(file);
+	ssize_t              delta;
+	struct ether_addr    addr[1];
+	char                 name[MAXHOSTNAMELEN];
+	reader.input  = tail;
+	reader.quiet  = true;
+	reader.leases = claims != NULL;
+
+	while ((delta = ethers_reader_read(&reader, addr, name)) != 0) {
+		if (delta == ETHERS_RELEASE) {
+			match_release(matches, requests, count, addr, name);
+		} else if (delta == ETHERS_ENTRY) {
+			match_entry(matches, requests, count, addr, name);
+			if (claims != NULL) {
+				lookup_add(matches->arena, claims, addr_to_u64(*addr));
+			}
+		} else if (delta == ETHERS_LEASE && claims != NULL) {
+			leases_add(&claims->leases, addr, name, reader.lease);
+		}
+	}
+}
+
+static int
+compare_packed(const void *_Nonnull const a, const void *_Nonnull const b)
+{
+	const uint64_t left  = *(const uint64_t *)a & ~LOOKUP_RELEASE;
+	const uint64_t right = *(const uint64_t *)b & ~LOOKUP_RELEASE;
+	return (left > right) - (left < right);
+}
+
+// Merge the lease records of every file in order so later records replace earlier ones.
+static struct leases
+collect_leases(struct arena arena[const static 1], const struct lookups lookups[const static 1])
+{
+	struct leases leases = LEASES_INIT(arena);
+	for (size_t i = 0; i < lookups->count; i++) {
+		const struct leases *_Nonnull const found = &lookups->lookup[i].leases;
+		for (size_t j = 0; j < found->count; j++) {
+			const struct lease *_Nonnull const lease = &found->lease[j];
+			leases_add(&leases, &lease->first, lease->owner, (struct ethers_lease){ .count = lease->count, .expires = lease->expires });
+		}
+	}
+	return leases;
+}
+
+// Build the allocator from the addresses of every file.
+// A stable sort keeps the records of each address in file order so the last one decides if it is still claimed,
+// which leaves an ascending array of claimed addresses to bulk load instead of replaying claims one at a time.
+// The live leases of every other owner are claimed as a whole to keep their addresses out of reach.
+static struct allocator
+load_allocator(struct arena arena[const static 1], const struct lookups lookups[const static 1], const struct leases leases[const static 1],
+               const char *_Nullable const owner, const struct ether_addr min, const struct ether_addr max)
+{
+	size_t total = 0;
+	for (size_t i = 0; i < lookups->count; i++) {
+		total += lookups->lookup[i].count;
+	}
+
+	uint64_t *_Nullable packed = lookups->count == 1 ? lookups->lookup[0].addrs : NULL;
+	if (lookups->count > 1) {
+		packed = arena_alloc(arena, total, sizeof(uint64_t));
+		size_t offset = 0;
+		for (size_t i = 0; i < lookups->count; i++) {
+			const struct lookup *_Nonnull const lookup = &lookups->lookup[i];
+			if (lookup->count != 0) {
+				memcpy(&packed[offset], lookup->addrs, lookup->count * sizeof(uint64_t));
+			}
+			offset += lookup->count;
+		}
+	}
+
+	size_t claimed = 0;
+	if (total != 0) {
+		if (mergesort(packed, total, sizeof(uint64_t), compare_packed) != 0) {
+			xo_err(EX_OSERR, "Failed to sort %zu addresses", total);
+		}
+		for (size_t i = 0; i < total; i++) {
+			const bool last = i + 1 == total || ((packed[i] ^ packed[i + 1]) & ~LOOKUP_RELEASE) != 0;
+			if (last && (packed[i] & LOOKUP_RELEASE) == 0) {
+				packed[claimed++] = packed[i];
+			}
+		}
+	}
+
+	const struct allocator allocator = allocator_create(min, max);
+	if (claimed != 0) {
+		allocator_claim_sorted(allocator, packed, claimed);
+	}
+
+	const uint64_t now = (uint64_t)time(NULL);
+	for (size_t i = 0; i < leases->count; i++) {
+		const struct lease *_Nonnull const lease = &leases->lease[i];
+		if (lease_live(lease, now) && (owner == NULL || strcmp(lease->owner, owner) != 0)) {
+			allocator_claim_range(allocator, &lease->first, lease->count);
+		}
+	}
+	return allocator;
+}
+
+// Allocate from the owner's usable leases before reserving a new lease if -L asks for one.
+// Reserving a lease needs the exclusive lock like any allocation outside of a lease.
+static bool
+allocate_leased(struct allocator allocator, struct leases leases[const static 1], const struct cli_args args[const static 1],
+                struct ethers_writer writer[const static 1], struct ether_addr addr[const static 1], bool exclusive[const static 1])
+{
+	const uint64_t now = (uint64_t)time(NULL);
+	for (size_t i = 0; i < leases->count; i++) {
+		const struct lease *_Nonnull const lease = &leases->lease[i];
+		if (lease_usable(lease, args->owner, now) && allocator_alloc_range(allocator, &lease->first, lease->count, addr)) {
+			return true;
+		}
+	}
+
+	struct ether_addr first[1];
+	if (args->lease_count == 0 || !allocator_alloc_block(allocator, (unsigned)__builtin_ctzll(args->lease_count), first)) {
+		return false;
+	}
+	allocator_release_range(allocator, first, args->lease_count);
+
+	const struct ethers_lease lease = { .count = args->lease_count, .expires = now + args->lease_seconds };
+	if (ethers_writer_lease(writer, first, args->owner, lease) < 0) {
+		xo_err(EX_OSERR, "Failed to buffer new lines");
+	}
+	leases_add(leases, first, args->owner, lease);
+	*exclusive = true;
+	return allocator_alloc_range(allocator, first, args->lease_count, addr);
+}
+
+// Hostnames without a mapping after the scan are the only reason to build the allocator.
+static bool
+unresolved_requests(const struct request requests[const], const size_t count)
+{
+	for (size_t i = 0; i < count; i++) {
+		if (requests[i].found == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Allocate from the private allocator for the unresolved hostnames without an address yet.
+static void
+allocate_private(struct allocator allocator, struct leases leases[const static 1], struct ethers_writer writer[const static 1],
+                 const struct request requests[const], uint64_t allocated[const], const size_t count, bool exclusive[const static 1])
+{
+	const struct cli_args *_Nonnull const args = writer->file->args;
+	for (size_t i = 0; i < count; i++) {
+		const struct request *_Nonnull const request = &requests[i];
+		if (request->found != 0 || allocated[i] != UNALLOCATED) {
+			continue;
+		} else if (request->block) {
+			allocate_block(allocator, request, &allocated[i]);
+			*exclusive = true;
+			continue;
+		}
+		struct ether_addr addr[1];
+		if (args->owner == NULL || !allocate_leased(allocator, leases, args, writer, addr, exclusive)) {
+			if (!allocator_alloc(allocator, addr)) {
+				xo_errx(EX_UNAVAILABLE, "Failed to allocate MAC address for hostname '%s'.", request->name);
+			}
+			*exclusive = true;
+		}
+		allocated[i] = addr_to_u64(*addr);
+	}
+}
+
+// Give back the addresses claimed from the shared bitmap.
+static void
+release_shared(const struct shared_allocator shared[const static 1], const struct request requests[const],
+               uint64_t allocated[const], const size_t count)
+{
+	for (size_t i = 0; shared->header != NULL && i < count; i++) {
+		if (allocated[i] != UNALLOCATED) {
+			shared_allocator_free(shared, requests[i].block ? requests[i].order : 0, u64_to_addr(allocated[i]));
+			allocated[i] = UNALLOCATED;
+		}
+	}
+}
+
+// Blocks are mapped as a whole. Fail if only some of a block's addresses are mapped
+// or a new block can't be aligned to its size because the allocators align blocks relative to <min>,
+// giving back the addresses already claimed from the shared bitmap first.
+static void
+check_blocks(const struct shared_allocator shared[const static 1], const struct request requests[const],
+             uint64_t allocated[const], const size_t count, const struct ether_addr min)
+{
+	for (size_t i = 0; i < count; i++) {
+		const struct request *_Nonnull const request = &requests[i];
+		const uint64_t                       size    = UINT64_C(1) << request->order;
+		if (request->found != 0 && request->found != size) {
+			release_shared(shared, requests, allocated, count);
+			xo_errx(EX_DATAERR, "Only %" PRIu64 " of the %" PRIu64 " addresses in block '%s' are mapped.",
+				request->found, size, request->name);
+		} else if (request->found == 0 && allocated[i] == UNALLOCATED && (addr_to_u64(min) & (size - 1)) != 0) {
+			release_shared(shared, requests, allocated, count);
+			xo_errx(EX_USAGE, "The minimum MAC address isn't aligned to the %" PRIu64 " addresses of block '%s'.",
+				size, request->name);
+		}
+	}
+}
+
+// Returns true if any of the addresses [first, first + count) is in the sorted claimed addresses.
+static bool
+claimed_range(const uint64_t sorted[const], const size_t claimed, const uint64_t first, const uint64_t count)
+{
+	size_t low  = 0;
+	size_t high = claimed;
+	while (low < high) {
+		const size_t middle = low + (high - low) / 2;
+		if (sorted[middle] < first) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	return low < claimed && sorted[low] - first < count;
+}
+
+// Returns true if the lease keeps the owner (or writers without an owner) out of its addresses.
+static bool
+foreign_lease(const struct lease lease[const static 1], const char *_Nullable const owner, const uint64_t now)
+{
+	return lease_live(lease, now) && (owner == NULL || strcmp(lease->owner, owner) != 0);
+}
+
+// Move the private allocations out of the way of the lines other writers appended since the files were read.
+// Hostnames they mapped keep their mapping, the hostnames they released and the allocations
+// colliding with their addresses or leases are allocated again.
+static void
+recheck_private(struct allocator allocator, struct leases leases[const static 1], struct ethers_writer writer[const static 1],
+                const struct lookup claims[const static 1], const struct request requests[const], uint64_t allocated[const],
+                const size_t count, bool exclusive[const static 1])
+{
+	const char *_Nullable const owner  = writer->file->args->owner;
+	const uint64_t              now    = (uint64_t)time(NULL);
+	uint64_t *_Nullable const   sorted = claims->addrs;
+	for (size_t i = 0; i < count; i++) {
+		const struct ether_addr first[1] = { u64_to_addr(allocated[i]) };
+		if (requests[i].found != 0 && allocated[i] != UNALLOCATED) {
+			allocator_release_range(allocator, first, UINT64_C(1) << requests[i].order);
+			allocated[i] = UNALLOCATED;
+		}
+	}
+
+	if (claims->count != 0) {
+		qsort(sorted, claims->count, sizeof(uint64_t), compare_packed);
+		allocator_claim_sorted(allocator, sorted, claims->count);
+	}
+	for (size_t i = 0; i < claims->leases.count; i++) {
+		const struct lease *_Nonnull const lease = &claims->leases.lease[i];
+		if (foreign_lease(lease, owner, now)) {
+			allocator_claim_range(allocator, &lease->first, lease->count);
+		}
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		const uint64_t size     = UINT64_C(1) << requests[i].order;
+		bool           collides = allocated[i] != UNALLOCATED && claimed_range(sorted, claims->count, allocated[i], size);
+		for (size_t j = 0; !collides && allocated[i] != UNALLOCATED && j < claims->leases.count; j++) {
+			const struct lease *_Nonnull const lease = &claims->leases.lease[j];
+			const uint64_t                     first = addr_to_u64(lease->first);
+			collides = foreign_lease(lease, owner, now) && allocated[i] < first + lease->count && first < allocated[i] + size;
+		}
+		if (collides) {
+			allocated[i] = UNALLOCATED;
+		}
+	}
+
+	check_blocks(&SHARED_ALLOCATOR_NONE, requests, allocated, count, writer->file->args->min_mac);
+	allocate_private(allocator, leases, writer, requests, allocated, count, exclusive);
+}
+
+// Claim the unresolved hostnames without an address yet from the shared bitmap instead of a private allocator.
+// If a request can't be satisfied the addresses already claimed are given back before failing.
+static void
+allocate_shared(const struct shared_allocator shared[const static 1], const struct request requests[const],
+                uint64_t allocated[const], const size_t count)
+{
+	for (size_t i = 0; i < count; i++) {
+		const struct request *_Nonnull const request = &requests[i];
+		struct ether_addr                    addr[1];
+		if (request->found != 0 || allocated[i] != UNALLOCATED) {
+			continue;
+		} else if (request->block ? !shared_allocator_alloc_block(shared, request->order, addr) : !shared_allocator_alloc(shared, addr)) {
+			release_shared(shared, requests, allocated, count);
+			xo_errx(EX_UNAVAILABLE, "Failed to allocate MAC address%s for hostname '%s'.", request->block ? " block" : "", request->name);
+		}
+		allocated[i] = addr_to_u64(*addr);
+	}
+}
+
+// Give back the addresses of hostnames other writers mapped since the file was read
+// and claim addresses for the hostnames they released.
+static void
+recheck_shared(const struct shared_allocator shared[const static 1], const struct request requests[const],
+               uint64_t allocated[const], const size_t count)
+{
+	for (size_t i = 0; i < count; i++) {
+		if (requests[i].found != 0 && allocated[i] != UNALLOCATED) {
+			shared_allocator_free(shared, requests[i].block ? requests[i].order : 0, u64_to_addr(allocated[i]));
+			allocated[i] = UNALLOCATED;
+		}
+	}
+	check_blocks(shared, requests, allocated, count, u64_to_addr(shared->header->offset));
+	allocate_shared(shared, requests, allocated, count);
+}
+
 static void
-allocate_entries(const struct ethers_file file[const static 1])
+allocate_entries(const struct ethers_files files[const static 1])
 {
+	const struct ethers_file   *_Nonnull const file        = &files->file[files->writable];
 	const struct cli_args      *_Nonnull const args        = file->args;
 	const char *_Nonnull const *_Nonnull const start       = args->names_start;
 	const char *_Nonnull const *_Nonnull const end         = args->names_end;
-	const char *_Nonnull const                 ethers_path = args->ethers_path;
 	const struct ether_addr                    min         = args->min_mac;
 	const struct ether_addr                    max         = args->max_mac;
 
+	struct arena                   arena     __attribute__((cleanup(arena_cleanup)))     = ARENA_INIT;
+	const size_t                   count     = (size_t)(end - start);
+	struct request *_Nonnull const requests  = parse_requests(&arena, start, count);
+	struct mappings                matches   = MAPPINGS_INIT(&arena);
+	const struct lookups           lookups   = lookup_entries(&arena, files, requests, count);
+	uint64_t *_Nonnull const       allocated = arena_alloc(&arena, count, sizeof(uint64_t));
+	replay_lookups(&lookups, &matches, requests, count);
+	for (size_t i = 0; i < count; i++) {
+		allocated[i] = UNALLOCATED;
+	}
+
 	open_entries();
 
-	size_t count = (size_t)(end - start);
-	const char *_Nonnull names[count];
-	for (size_t i = 0; i < (size_t)(end - start); i++) {
-		names[i] = start[i];
+	struct ethers_writer writer = ethers_writer_create(file, &arena);
+
+	// The shared bitmap stays locked until the appended lines are committed to it.
+	struct shared_allocator shared __attribute__((cleanup(shared_allocator_cleanup))) = SHARED_ALLOCATOR_NONE;
+	check_blocks(&shared, requests, allocated, count, min);
+	if (args->shared && unresolved_requests(requests, count)) {
+		shared = shared_allocator_open(file, min, max);
+		allocate_shared(&shared, requests, allocated, count);
+
+		// Only appending is serialized, allocating stays concurrent.
+		// Other writers could have mapped the same hostnames since the file was read.
+		writer.leased = true;
+		for (struct valid tail = ethers_writer_lock(&writer); !is_empty(tail); tail = ethers_writer_lock(&writer)) {
+			replay_tail(file, tail, &matches, requests, count, NULL);
+			recheck_shared(&shared, requests, allocated, count);
+		}
+	} else if (unresolved_requests(requests, count)) {
+		struct leases    leases    = collect_leases(&arena, &lookups);
+		struct allocator allocator __attribute__((cleanup(allocator_cleanup))) = load_allocator(&arena, &lookups, &leases, args->owner, min, max);
+		bool             exclusive = args->owner == NULL;
+		allocate_private(allocator, &leases, &writer, requests, allocated, count, &exclusive);
+
+		// Other writers could have appended to the file (or the other shards) between reading and locking it.
+		// Their addresses are claimed and the allocations colliding with them are moved.
+		// Appending only inside already reserved leases serializes on the append lock instead of the exclusive lock
+		// until an allocation has to be moved out of the leases.
+		writer.shards = files;
+		writer.leased = !exclusive;
+		for (struct valid tail = ethers_writer_lock(&writer); !is_empty(tail); tail = ethers_writer_lock(&writer)) {
+			struct lookup claims = { .addrs = NULL, .count = 0, .capacity = 0, .records = MAPPINGS_INIT(&arena), .leases = LEASES_INIT(&arena) };
+			replay_tail(file, tail, &matches, requests, count, &claims);
+			recheck_private(allocator, &leases, &writer, &claims, requests, allocated, count, &exclusive);
+			writer.leased = !exclusive;
+		}
 	}
 
-	struct allocator allocator __attribute__((cleanup(allocator_cleanup))) = allocator_create(min, max);
+	for (size_t i = 0; i < matches.count; i++) {
+		const struct mapping *_Nonnull const mapping = &matches.mapping[i];
+		emit_entry(&mapping->addr, mapping->name);
+	}
+	write_allocated(&writer, requests, allocated, count);
 
-	struct ethers_reader reader = ethers_reader_create(file); 
-	struct ethers_buffer buffer = ETHERS_BUFFER_INIT;
-	struct ethers_writer writer __attribute__((cleanup(ethers_writer_close))) = ethers_writer_create(file, &buffer);
+	const ssize_t written = ethers_writer_flush(&writer);
+	if (written < 0) {
+		release_shared(&shared, requests, allocated, count);
+		xo_err(EX_OSERR, "Failed to write new mappings to ethers(5) file: %s", file->path);
+	}
+	shared_allocator_commit(&shared, (uint64_t)written);
 
-	{
-		ssize_t           delta;
-		struct ether_addr addr[1];
-		char              name[MAXHOSTNAMELEN];
-		for (delta = ethers_reader_read(&reader, addr, name); delta > 0; delta = ethers_reader_read(&reader, addr, name)) {
-			allocator_claim(allocator, addr);
-			for (size_t i = 0; i < count; i++) {
-				if (!strcmp(name, names[i])) {
-					names[i] = names[--count];
-					emit_entry(addr, name);
-					break;
-				}
+	close_entries();
+	emit_lock_wait(&writer);
+}
+
+// Release records are the only records that could still change the matches once every hostname is found.
+// Search the unread rest of the current file and all later files for the marker without parsing them.
+static bool
+release_follows(const struct valid rest, const struct ethers_files files[const static 1], const size_t next)
+{
+	static const char marker[] = ETHERS_RELEASE_MARKER;
+	if (memmem(rest.start, valid_length(rest), marker, sizeof(marker) - 1) != NULL) {
+		return true;
+	}
+	for (size_t i = next; i < files->count; i++) {
+		const struct valid map = files->file[i].map;
+		if (memmem(map.start, valid_length(map), marker, sizeof(marker) - 1) != NULL) {
+			return true;
+		}
+	}
+	return false;
+}
+
+#define BISECT_NAMES 65536
+
+// Look up the hostnames still missing in lines sorted by name one bisection per hostname.
+// The entries found are only matched once every bisection succeeded. Returns false without matching any
+// if the lines can't be bisected, otherwise adds the number of hostnames found to *found.
+static bool
+bisect_requests(const struct ethers_file file[const static 1], const struct valid lines, struct mappings matches[const static 1],
+                struct request requests[const], const size_t count, uint64_t found[const static 1])
+{
+	struct mappings entries = MAPPINGS_INIT(matches->arena);
+	for (size_t i = 0; i < count; i++) {
+		const struct request *_Nonnull const request = &requests[i];
+		const uint64_t                       names   = UINT64_C(1) << request->order;
+		for (uint64_t j = 0; request->found < names && j < names; j++) {
+			struct ether_addr addr[1];
+			char              name[MAXHOSTNAMELEN];
+			const int         length = request->block ? snprintf(name, sizeof(name), "%.*s-%" PRIu64, (int)request->length, request->name, j)
+			                                          : snprintf(name, sizeof(name), "%s", request->name);
+			if (length < 0 || (size_t)length >= sizeof(name)) {
+				break;
+			}
+			const int result = ethers_bisect(file, lines, name, addr);
+			if (result == ETHERS_BISECT_UNSORTED) {
+				return false;
+			} else if (result == ETHERS_BISECT_FOUND) {
+				mappings_add(&entries, addr, name, false);
+			}
+		}
+	}
+
+	for (size_t i = 0; i < entries.count; i++) {
+		const struct mapping *_Nonnull const entry = &entries.mapping[i];
+		*found += match_entry(matches, requests, count, &entry->addr, entry->name);
+	}
+	return true;
+}
+
+// Look up the requested hostnames without building an allocator or writer.
+// The files are read in order on the calling thread to stop as soon as
+// every hostname is found. Returns false if any hostname isn't mapped.
+static bool
+resolve_entries(const struct ethers_files files[const static 1])
+{
+	const struct cli_args      *_Nonnull const args        = files->file[0].args;
+	const char *_Nonnull const *_Nonnull const start       = args->names_start;
+	const char *_Nonnull const *_Nonnull const end         = args->names_end;
+
+	struct arena                   arena    __attribute__((cleanup(arena_cleanup))) = ARENA_INIT;
+	const size_t                   count    = (size_t)(end - start);
+	struct request *_Nonnull const requests = parse_requests(&arena, start, count);
+	struct mappings                matches  = MAPPINGS_INIT(&arena);
+	uint64_t                       pending  = 0;
+	for (size_t i = 0; i < count; i++) {
+		pending += UINT64_C(1) << requests[i].order;
+	}
+
+	if (args->verbose) {
+		open_dump();
+	}
+	bool done = count == 0;
+	for (size_t i = 0; !done && i < files->count; i++) {
+		struct ethers_reader reader = ethers_reader_create(&files->file[i]);
+		ssize_t              delta  = 0;
+		struct ether_addr    addr[1];
+		char                 name[MAXHOSTNAMELEN];
+
+		// Bisect the lines sorted by name unless every line has to be dumped
+		// or so many hostnames are missing that a linear scan is cheaper.
+		const struct ethers_sorted sorted = ethers_sorted(&files->file[i]);
+		uint64_t                   found  = 0;
+		if (sorted.by_name && !args->verbose && pending <= BISECT_NAMES &&
+		    bisect_requests(&files->file[i], sorted.lines, &matches, requests, count, &found)) {
+			pending -= found;
+			reader.input = sorted.tail;
+			done = pending == 0 && !release_follows(reader.input, files, i + 1);
+		}
+
+		while (!done && (delta = ethers_reader_read(&reader, addr, name)) > 0) {
+			if (args->verbose) {
+				print_entry(addr, name, delta == ETHERS_RELEASE);
+			}
+			if (delta == ETHERS_RELEASE) {
+				pending += match_release(&matches, requests, count, addr, name);
+			} else if (match_entry(&matches, requests, count, addr, name) && --pending == 0) {
+				done = !release_follows(reader.input, files, i + 1);
 			}
 		}
 		if (delta < 0) {
-			xo_err(EX_DATAERR, "Failed read in line %zu of ethers file '%s'.", reader.line_number, ethers_path);
+			xo_errx(EX_DATAERR, "Failed read in line %zu of ethers file '%s'.", reader.line_number, files->file[i].path);
+		}
+	}
+	if (args->verbose) {
+		close_dump();
+	}
+
+	open_entries();
+
+	for (size_t i = 0; i < count; i++) {
+		const struct request *_Nonnull const request = &requests[i];
+		if (request->found != 0 && request->found != (UINT64_C(1) << request->order)) {
+			xo_errx(EX_DATAERR, "Only %" PRIu64 " of the %" PRIu64 " addresses in block '%s' are mapped.",
+				request->found, UINT64_C(1) << request->order, request->name);
 		}
 	}
 
+	for (size_t i = 0; i < matches.count; i++) {
+		const struct mapping *_Nonnull const mapping = &matches.mapping[i];
+		emit_entry(&mapping->addr, mapping->name);
+	}
+
 	for (size_t i = 0; i < count; i++) {
-		const char *_Nonnull const name = names[i];
-		struct ether_addr addr[1];
-		const bool ok = allocator_alloc(allocator, addr);
-		if (!ok) {
-			xo_errx(EX_UNAVAILABLE, "Failed to allocate MAC address for hostname '%s'.", name);
+		if (requests[i].found == 0) {
+			xo_warnx("No mapping for hostname '%s'.", requests[i].name);
 		}
-		emit_entry(addr, name);
-		if (ethers_writer_write(&writer, addr, name) < 0) {
-			xo_err(EX_OSERR, "Failed to write to memory stream");
+	}
+
+	close_entries();
+	return pending == 0;
+}
+
+// Append release records for the current mappings of the requested names.
+static void
+release_entries(const struct ethers_files files[const static 1])
+{
+	const struct ethers_file   *_Nonnull const file        = &files->file[files->writable];
+	const struct cli_args      *_Nonnull const args        = file->args;
+	const char *_Nonnull const *_Nonnull const start       = args->names_start;
+	const char *_Nonnull const *_Nonnull const end         = args->names_end;
+
+	struct arena                   arena    __attribute__((cleanup(arena_cleanup))) = ARENA_INIT;
+	const size_t                   count    = (size_t)(end - start);
+	struct request *_Nonnull const requests = parse_requests(&arena, start, count);
+	struct mappings                matches  = MAPPINGS_INIT(&arena);
+	const struct lookups           lookups  = lookup_entries(&arena, files, requests, count);
+	replay_lookups(&lookups, &matches, requests, count);
+
+	open_entries();
+
+	struct ethers_writer writer = ethers_writer_create(file, &arena);
+
+	for (size_t i = 0; i < count; i++) {
+		if (requests[i].found == 0) {
+			xo_warnx("No mapping to release for hostname '%s'.", requests[i].name);
+		}
+	}
+
+	for (size_t i = 0; i < matches.count; i++) {
+		const struct mapping *_Nonnull const mapping = &matches.mapping[i];
+		emit_entry(&mapping->addr, mapping->name);
+		if (ethers_writer_release(&writer, &mapping->addr, mapping->name) < 0) {
+			xo_err(EX_OSERR, "Failed to buffer new lines");
+		}
+	}
+
+	// Return every live lease of the owner to make its unmapped addresses available to all writers again.
+	if (args->owner != NULL) {
+		const struct leases leases = collect_leases(&arena, &lookups);
+		const uint64_t      now    = (uint64_t)time(NULL);
+		for (size_t i = 0; i < leases.count; i++) {
+			const struct lease *_Nonnull const lease = &leases.lease[i];
+			if (lease_live(lease, now) && strcmp(lease->owner, args->owner) == 0 &&
+			    ethers_writer_lease(&writer, &lease->first, lease->owner, (struct ethers_lease){ .count = lease->count, .expires = 0 }) < 0) {
+				xo_err(EX_OSERR, "Failed to buffer new lines");
+			}
 		}
 	}
 
 	if (ethers_writer_flush(&writer) < 0) {
-		xo_err(EX_OSERR, "Failed to write new mappings to ethers(5) file: %s", file->args->ethers_path);
+		xo_err(EX_OSERR, "Failed to write release records to ethers(5) file: %s", file->path);
+	}
+
+	close_entries();
+	emit_lock_wait(&writer);
+}
+
+// Emit the live mappings whose hostnames match any of the glob(7) patterns.
+// Each pattern only scans the range of the name index sharing its literal prefix.
+static bool
+query_entries(const struct ethers_files files[const static 1])
+{
+	const struct cli_args *_Nonnull const args  = files->file[0].args;
+	struct arena                          arena __attribute__((cleanup(arena_cleanup))) = ARENA_INIT;
+	struct records                        records = RECORDS_INIT(&arena);
+	for (size_t i = 0; i < files->count; i++) {
+		struct ethers_reader reader = ethers_reader_create(&files->file[i]);
+		read_records(&records, &reader);
+	}
+	const struct name_index index   = name_index_create(&records);
+	bool *_Nonnull const    emitted = arena_alloc(&arena, index.count, sizeof(bool));
+	memset(emitted, 0, index.count * sizeof(bool));
+
+	open_entries();
+
+	// Overlapping patterns (e.g. 'rack*' and 'rack1*') match some records more than once, emit them only the first time.
+	bool found = false;
+	for (const char *_Nonnull const *_Nonnull pattern = args->names_start; pattern != args->names_end; pattern++) {
+		struct name_query query = name_index_query(&index, *pattern);
+		for (const struct record *_Nullable record = name_index_next(&index, &query); record != NULL; record = name_index_next(&index, &query)) {
+			const size_t position = (size_t)(record - index.record);
+			char         name[MAXHOSTNAMELEN];
+			if (!emitted[position]) {
+				emitted[position] = true;
+				emit_entry(&record->addr, record_name(record, name));
+			}
+			found = true;
+		}
 	}
 
 	close_entries();
+	return found;
+}
+
+static void
+report_usage(const struct ethers_files files[const static 1])
+{
+	const struct cli_args *_Nonnull const args      = files->file[0].args;
+	struct arena                          arena     __attribute__((cleanup(arena_cleanup)))     = ARENA_INIT;
+	const struct lookups                  lookups   = lookup_entries(&arena, files, NULL, 0);
+	const struct leases                   leases    = collect_leases(&arena, &lookups);
+	struct allocator                      allocator __attribute__((cleanup(allocator_cleanup))) =
+		load_allocator(&arena, &lookups, &leases, NULL, args->min_mac, args->max_mac);
+
+	const struct allocator_usage usage     = allocator_usage(allocator);
+	const double                 exhausted = allocator.size == 0 ? 100.0 : 100.0 * (double)usage.used / (double)allocator.size;
+	char                         min[sizeof("xx:xx:xx:xx:xx:xx")];
+	char                         max[sizeof("xx:xx:xx:xx:xx:xx")];
+
+	if (xo_emit("{Lc:Ranges}\n") < 0) {
+		xo_err(EX_IOERR, "Failed xo_emit()");
+	} else if (xo_open_marker("ranges") < 0) {
+		xo_err(EX_IOERR, "Failed xo_open_marker(\"ranges\")");
+	} else if (xo_open_list("ranges") < 0) {
+		xo_err(EX_IOERR, "Failed xo_open_list(\"ranges\")");
+	} else if (xo_open_instance("ranges") < 0) {
+		xo_err(EX_IOERR, "Failed xo_open_instance(\"ranges\")");
+	}
+
+	if (xo_emit("{P:  - }{L:Range}{D: = }{:min-mac}{D: - }{:max-mac}\n"
+	            "{P:    }{L:Size}{D: = }{:size/%" PRIu64 "}{D:, }{L:Used}{D: = }{:used/%" PRIu64 "}{D:, }{L:Free}{D: = }{:free/%" PRIu64 "}\n"
+	            "{P:    }{L:Exhausted}{D: = }{:exhausted/%.2f}{U:%%}{D:, }{L:Largest free run}{D: = }{:largest-free-run/%" PRIu64 "}\n",
+	            ether_ntoa_r(&args->min_mac, min), ether_ntoa_r(&args->max_mac, max),
+	            allocator.size, usage.used, usage.free, exhausted, usage.largest_run) < 0) {
+		xo_err(EX_IOERR, "Failed to emit range usage");
+	}
+
+	if (xo_emit("{P:    }{Lc:Free runs}\n") < 0) {
+		xo_err(EX_IOERR, "Failed xo_emit()");
+	} else if (xo_open_list("free-runs") < 0) {
+		xo_err(EX_IOERR, "Failed xo_open_list(\"free-runs\")");
+	}
+	for (unsigned bucket = 0; bucket < ALLOCATOR_RUN_BUCKETS; bucket++) {
+		if (usage.runs[bucket] == 0) {
+			continue;
+		} else if (xo_open_instance("free-runs") < 0) {
+			xo_err(EX_IOERR, "Failed xo_open_instance(\"free-runs\")");
+		} else if (xo_emit("{P:      - }{L:Length}{D: = }{:min-length/%" PRIu64 "}{D:-}{:max-length/%" PRIu64 "}{D:, }{L:Count}{D: = }{:count/%" PRIu64 "}\n",
+		                   UINT64_C(1) << bucket, (UINT64_C(2) << bucket) - 1, usage.runs[bucket]) < 0) {
+			xo_err(EX_IOERR, "Failed to emit free run histogram");
+		} else if (xo_close_instance("free-runs") < 0) {
+			xo_err(EX_IOERR, "Failed xo_close_instance(\"free-runs\")");
+		}
+	}
+	if (xo_close_list("free-runs") < 0) {
+		xo_err(EX_IOERR, "Failed xo_close_list(\"free-runs\")");
+	} else if (xo_close_marker("ranges") < 0) {
+		xo_err(EX_IOERR, "Failed xo_close_marker(\"ranges\")");
+	}
+}
+
+// Emit the entries of the file and then every entry appended to it until the file is replaced.
+static void
+follow_entries(const struct ethers_file file[const static 1])
+{
+	struct follow follow __attribute__((cleanup(follow_cleanup))) = follow_create(file);
+	struct valid  lines;
+	size_t        line_number;
+
+	while (follow_next(&follow, &lines, &line_number)) {
+		struct ethers_reader reader = ethers_reader_create(file);
+		ssize_t              delta;
+		struct ether_addr    addr[1];
+		char                 name[MAXHOSTNAMELEN];
+
+		reader.input       = lines;
+		reader.line_number = line_number;
+
+		// Keep following after invalid lines (ethers_reader_read() warns about them).
+		while ((delta = ethers_reader_read(&reader, addr, name)) != 0) {
+			if (delta > 0) {
+				print_entry(addr, name, delta == ETHERS_RELEASE);
+			}
+		}
+		if (xo_flush() < 0) {
+			xo_err(EX_IOERR, "Failed xo_flush()");
+		}
+	}
+}
+
+// Reopen the followed file once it exists again without creating it.
+// It can disappear again between waiting for it and opening it.
+static struct ethers_file
+reopen_file(const struct ethers_file file[const static 1])
+{
+	for (;;) {
+		follow_await(file->path);
+		const struct ethers_file reopened = ethers_file_reopen(file->args, file->path);
+		if (reopened.fd >= 0) {
+			return reopened;
+		}
+	}
+}
+
+// Follow the ethers file forever reopening it whenever it's replaced (e.g. by a compaction).
+// All entries of a replacement are emitted again after a replaced marker.
+// A removed file is waited for until it's created again.
+static void __attribute__((noreturn))
+follow_file(const struct ethers_file file[const static 1])
+{
+	if (xo_emit("{Lc:Entries}\n") < 0) {
+		xo_err(EX_IOERR, "Failed xo_emit()");
+	}
+	open_entries();
+	follow_entries(file);
+	for (;;) {
+		if (xo_open_instance("entries") < 0) {
+			xo_err(EX_IOERR, "Failed xo_open_instance(\"entries\")");
+		} else if (xo_emit("{P:  - }{L:Replaced}{D: = }{:replaced}\n", "true") < 0) {
+			xo_err(EX_IOERR, "Failed to emit replaced marker");
+		} else if (xo_close_instance("entries") < 0) {
+			xo_err(EX_IOERR, "Failed xo_close_instance(\"entries\")");
+		}
+		const struct ethers_file reopened __attribute__((cleanup(ethers_file_cleanup))) = reopen_file(file);
+		follow_entries(&reopened);
+	}
 }
 
 int
@@ -226,16 +1041,46 @@ main(int argc, char **argv)
 		print_cli_args(&args);
 	}
 
-	const struct ethers_file file __attribute__((cleanup(ethers_file_cleanup))) = ethers_file_open(&args);
+	const struct ethers_files files __attribute__((cleanup(ethers_files_cleanup))) = ethers_files_open(&args);
+	int                       status = EX_OK;
 
-	if (args.verbose) {
-		print_entries(&file);
+	// Following and compacting replay a single file and can't span shards.
+	if ((args.follow || args.compact) && files.paths != NULL) {
+		xo_errx(EX_USAGE, "Following and compacting an ethers directory isn't supported, select a single shard.");
+	} else if (args.follow && is_snapshot(&files.file[0].snapshot)) {
+		xo_errx(EX_USAGE, "Following a binary snapshot isn't supported.");
 	}
 
-	allocate_entries(&file); 
+	// The shared bitmap only tracks the appends to a single text file.
+	if (args.shared && (files.paths != NULL || is_snapshot(&files.file[0].snapshot))) {
+		xo_errx(EX_USAGE, "The shared allocator requires a single ethers file, not a directory or binary snapshot.");
+	}
+
+	// The other modes dump the entries while reading them, following emits all of them anyway.
+	if (args.verbose && args.compact) {
+		print_entries(&files);
+	}
+
+	if (args.follow) {
+		follow_file(&files.file[0]);
+	} else if (args.compact) {
+		ethers_compact(&files.file[0], args.compact_by_name);
+	} else if (args.export_path != NULL) {
+		snapshot_export(&files, args.export_path);
+	} else if (args.query) {
+		status = query_entries(&files) ? EX_OK : EX_NOHOST;
+	} else if (args.report) {
+		report_usage(&files);
+	} else if (args.release) {
+		release_entries(&files);
+	} else if (args.lookup) {
+		status = resolve_entries(&files) ? EX_OK : EX_NOHOST;
+	} else {
+		allocate_entries(&files);
+	}
 
 	xo_close_container(prog_name);
-	return EX_OK;
+	return status;
 }
 
 #pragma clang diagnostic pop
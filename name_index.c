@@ -0,0 +1,99 @@
+// vim: ft=c:ts=8 :
+
+#include "compact.h"
+#include "name_index.h"
+
+// Include system headers from subdirectories.
+#include <sys/param.h>
+
+// Include system headers
+#include <fnmatch.h>
+#include <stdbool.h>
+#include <string.h>
+
+#if __STDC_VERSION__ >= 202311L
+static_assert(true); // Workaround for https://github.com/clangd/clangd/issues/1167
+#endif 
+
+#pragma clang diagnostic push
+
+// Set *very* aggressive diagnostics specific to clang (version 19.1.3).
+// These diagnostics aren't stable between compiler versions.
+// If used like this they're **EXPECTED** to break break the build,
+// but they're also useful for catching errors.
+// Use `make debug` to build with these diagnostics.
+#ifdef RACONIC
+#pragma clang diagnostic error   "-Weverything"
+#pragma clang diagnostic ignored "-Wunsafe-buffer-usage"
+#pragma clang diagnostic ignored "-Wdeclaration-after-statement"
+#pragma clang diagnostic ignored "-Wpre-c11-compat"
+#pragma clang diagnostic ignored "-Wpre-c23-compat"
+#pragma clang diagnostic ignored "-Wc2y-extensions"
+#pragma clang diagnostic ignored "-Wc++98-compat"
+#pragma clang diagnostic ignored "-Wnullability-extension"
+#pragma clang diagnostic ignored "-Wvla"
+#pragma clang diagnostic ignored "-Wgnu-statement-expression"
+#pragma clang diagnostic ignored "-Wgnu-conditional-omitted-operand"
+#pragma clang diagnostic ignored "-Wgnu-case-range"
+#pragma clang diagnostic ignored "-Wgnu-designator"
+#endif
+
+// Characters starting a wildcard (or escaping the next character) in a glob(7) pattern.
+#define NAME_INDEX_GLOB "*?[\\"
+
+// Sort the live mappings by hostname.
+struct name_index
+name_index_create(struct records records[const static 1])
+{
+	const size_t live = live_records(records, true);
+	return (struct name_index){ .record = records->record, .count = live };
+}
+
+// Returns the index of the first hostname whose first length characters compare at least
+// (or after if past is set) the prefix.
+static size_t
+lower_bound(const struct name_index index[const static 1], const char prefix[const static 1], const size_t length, const bool past)
+{
+	size_t first = 0;
+	size_t last  = index->count;
+	while (first < last) {
+		const size_t       middle = first + (last - first) / 2;
+		const struct valid name   = index->record[middle].name;
+		const int          order  = valid_compare(VALID(name.start, &name.start[MIN(valid_length(name), length)]), VALID(prefix, &prefix[length]));
+		if (order < 0 || (past && order == 0)) {
+			first = middle + 1;
+		} else {
+			last = middle;
+		}
+	}
+	return first;
+}
+
+// Only the hostnames starting with the literal prefix of the pattern can match it.
+// Bisect the range sharing the prefix so a query costs O(log n + range) instead of O(n).
+struct name_query
+name_index_query(const struct name_index index[const static 1], const char pattern[const static 1])
+{
+	const size_t literal = strcspn(pattern, NAME_INDEX_GLOB);
+	return (struct name_query){
+		.pattern = pattern,
+		.next    = lower_bound(index, pattern, literal, false),
+		.end     = lower_bound(index, pattern, literal, true)
+	};
+}
+
+// Returns the next live mapping matching the query or NULL once the range is exhausted.
+const struct record *_Nullable
+name_index_next(const struct name_index index[const static 1], struct name_query query[const static 1])
+{
+	while (query->next < query->end) {
+		const struct record *_Nonnull const record = &index->record[query->next++];
+		char                                name[MAXHOSTNAMELEN];
+		if (fnmatch(query->pattern, record_name(record, name), 0) == 0) {
+			return record;
+		}
+	}
+	return NULL;
+}
+
+#pragma clang diagnostic pop
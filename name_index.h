@@ -0,0 +1,56 @@
+// vim: ft=c:ts=8 :
+
+#ifndef NAME_INDEX_H
+#define NAME_INDEX_H
+
+#include <stddef.h>
+
+#include "compact.h"
+
+#if __STDC_VERSION__ >= 202311L
+static_assert(true); // Workaround for https://github.com/clangd/clangd/issues/1167
+#endif
+
+#pragma clang diagnostic push
+
+// Set *very* aggressive diagnostics specific to clang (version 19.1.3).
+// These diagnostics aren't stable between compiler versions.
+// If used like this they're **EXPECTED** to break break the build,
+// but they're also useful for catching errors.
+// Use `make debug` to build with these diagnostics.
+#ifdef RACONIC
+#pragma clang diagnostic error   "-Weverything"
+#pragma clang diagnostic ignored "-Wunsafe-buffer-usage"
+#pragma clang diagnostic ignored "-Wdeclaration-after-statement"
+#pragma clang diagnostic ignored "-Wpre-c11-compat"
+#pragma clang diagnostic ignored "-Wpre-c23-compat"
+#pragma clang diagnostic ignored "-Wc2y-extensions"
+#pragma clang diagnostic ignored "-Wc++98-compat"
+#pragma clang diagnostic ignored "-Wnullability-extension"
+#pragma clang diagnostic ignored "-Wvla"
+#pragma clang diagnostic ignored "-Wgnu-statement-expression"
+#pragma clang diagnostic ignored "-Wgnu-conditional-omitted-operand"
+#pragma clang diagnostic ignored "-Wgnu-case-range"
+#pragma clang diagnostic ignored "-Wgnu-designator"
+#endif
+
+// The live mappings sorted by hostname.
+// The records stay owned by the records' arena (and their hostnames by the mapped files).
+struct name_index {
+	const struct record *_Nullable record;
+	size_t                         count;
+};
+
+// A glob(7) pattern query over the range of the index sharing its literal prefix.
+struct name_query {
+	const char *_Nonnull pattern;
+	size_t               next;
+	size_t               end;
+};
+
+struct name_index    name_index_create(struct records records[const static 1]);
+struct name_query    name_index_query(const struct name_index index[const static 1], const char pattern[const static 1]);
+const struct record *_Nullable name_index_next(const struct name_index index[const static 1], struct name_query query[const static 1]);
+
+#pragma clang diagnostic pop
+#endif /* NAME_INDEX_H */
@@ -0,0 +1,379 @@
+// vim: ft=c:ts=8 :
+
+// A glibc nss(5) module answering ether_ntohost(3) and ether_hostton(3) (and getent ethers)
+// from a hashed index of the mmap(2)ed ethers(5) file instead of a linear scan per call.
+// The index is rebuilt whenever the file has been replaced, modified or appended to
+// and follows the same rules as ethers(1): the first mapping of a hostname wins until
+// a release record drops it.
+
+// Expose secure_getenv(3) and st_mtim.
+#define _GNU_SOURCE 1
+
+// Include system headers from subdirectories.
+#include <net/ethernet.h>
+#include <netinet/ether.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+
+// Include system headers
+#include <errno.h>
+#include <fcntl.h>
+#include <nss.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ethers_line.h"
+#include "scan.h"
+#include "slice.h"
+
+#if __STDC_VERSION__ >= 202311L
+static_assert(true); // Workaround for https://github.com/clangd/clangd/issues/1167
+#endif 
+
+#pragma clang diagnostic push
+
+// Set *very* aggressive diagnostics specific to clang (version 19.1.3).
+// These diagnostics aren't stable between compiler versions.
+// If used like this they're **EXPECTED** to break break the build,
+// but they're also useful for catching errors.
+// Use `make debug` to build with these diagnostics.
+#ifdef RACONIC
+#pragma clang diagnostic error   "-Weverything"
+#pragma clang diagnostic ignored "-Wunsafe-buffer-usage"
+#pragma clang diagnostic ignored "-Wdeclaration-after-statement"
+#pragma clang diagnostic ignored "-Wpre-c11-compat"
+#pragma clang diagnostic ignored "-Wpre-c23-compat"
+#pragma clang diagnostic ignored "-Wc2y-extensions"
+#pragma clang diagnostic ignored "-Wc++98-compat"
+#pragma clang diagnostic ignored "-Wnullability-extension"
+#pragma clang diagnostic ignored "-Wvla"
+#pragma clang diagnostic ignored "-Wgnu-statement-expression"
+#pragma clang diagnostic ignored "-Wgnu-conditional-omitted-operand"
+#pragma clang diagnostic ignored "-Wgnu-case-range"
+#pragma clang diagnostic ignored "-Wgnu-designator"
+#endif
+
+// Define string constants as macros (constexpr is a C23 feature).
+#define NSS_ETHERS_PATH     "/etc/ethers"
+#define NSS_ETHERS_PATH_ENV "NSS_ETHERS_FAST_PATH"
+
+// Everything else is hidden to stay out of the namespace of the programs loading the module.
+#define NSS_EXPORT          __attribute__((visibility("default")))
+
+// The result type of the glibc ethers database (only declared by glibc internally).
+struct etherent {
+	const char        *e_name;
+	struct ether_addr  e_addr;
+};
+
+// A record of the file. The hostname points into the mapped file.
+struct entry {
+	struct ether_addr    addr;
+	bool                 release;
+	bool                 live;
+	const char *_Nonnull name;
+	size_t               length;
+};
+
+// Open addressed hash tables of entry indices (plus one, zero marks an empty slot)
+// keyed by hostname and MAC address over the entries of the mapped file.
+struct index {
+	dev_t                   dev;
+	ino_t                   ino;
+	off_t                   size;
+	struct timespec         mtime;
+	void  *_Nullable        base;
+	struct entry *_Nullable entries;
+	size_t                  count;
+	uint32_t *_Nullable     names;
+	uint32_t *_Nullable     addrs;
+	size_t                  mask;
+};
+
+#define INDEX_INIT ((struct index) { \
+	.dev = 0, .ino = 0, .size = 0, .mtime = { .tv_sec = 0, .tv_nsec = 0 }, \
+	.base = NULL, .entries = NULL, .count = 0, .names = NULL, .addrs = NULL, .mask = 0 \
+})
+
+static pthread_mutex_t index_lock   = PTHREAD_MUTEX_INITIALIZER;
+static struct index    shared_index = INDEX_INIT;
+
+// Parse a single line into an entry. Returns false for empty, comment and invalid lines
+// (a library has no business printing warnings, ethers(1) reports them).
+static bool
+parse_line(const struct valid input, struct entry entry[const static 1])
+{
+	const struct split comment = split_comment(input);
+	struct valid       line    = comment.before;
+	entry->release = false;
+	entry->live    = false;
+
+	if (is_empty(trim_left_whitespace(line))) {
+		const struct maybe fields = ethers_line_marker(comment.after, ETHERS_RELEASE_MARKER);
+		if (is_null(fields)) {
+			return false;
+		}
+		line           = or_empty(fields);
+		entry->release = true;
+	}
+
+	struct maybe name = none;
+	if (ethers_line_mapping(line, &entry->addr, &name) != ETHERS_LINE_VALID) {
+		return false;
+	}
+	entry->name   = name.start;
+	entry->length = (size_t)(name.end - name.start);
+	return true;
+}
+
+static uint64_t
+hash_name(const char name[const], const size_t length)
+{
+	uint64_t hash = UINT64_C(0xcbf29ce484222325);
+	for (size_t i = 0; i < length; i++) {
+		hash = (hash ^ (unsigned char)name[i]) * UINT64_C(0x100000001b3);
+	}
+	return hash;
+}
+
+static uint64_t
+hash_addr(const struct ether_addr addr[const static 1])
+{
+	uint64_t packed = 0;
+	for (size_t i = 0; i < ETHER_ADDR_LEN; i++) {
+		packed = packed << 8 | ETHER_OCTETS(addr)[i];
+	}
+	packed *= UINT64_C(0x9e3779b97f4a7c15);
+	return packed ^ packed >> 29;
+}
+
+// Return the slot holding the hostname or the empty slot it would be inserted into.
+static size_t
+name_slot(const struct index index[const static 1], const char name[const], const size_t length)
+{
+	size_t slot = hash_name(name, length) & index->mask;
+	for (; index->names[slot] != 0; slot = (slot + 1) & index->mask) {
+		const struct entry *_Nonnull const entry = &index->entries[index->names[slot] - 1];
+		if (entry->length == length && memcmp(entry->name, name, length) == 0) {
+			break;
+		}
+	}
+	return slot;
+}
+
+static size_t
+addr_slot(const struct index index[const static 1], const struct ether_addr addr[const static 1])
+{
+	size_t slot = hash_addr(addr) & index->mask;
+	for (; index->addrs[slot] != 0; slot = (slot + 1) & index->mask) {
+		if (memcmp(&index->entries[index->addrs[slot] - 1].addr, addr, sizeof(*addr)) == 0) {
+			break;
+		}
+	}
+	return slot;
+}
+
+// Remove a hostname shifting the following entries of its probe sequence back into the hole.
+static void
+names_remove(struct index index[const static 1], const size_t slot)
+{
+	const size_t mask = index->mask;
+	size_t       hole = slot;
+	for (size_t next = (slot + 1) & mask; index->names[next] != 0; next = (next + 1) & mask) {
+		const struct entry *_Nonnull const entry = &index->entries[index->names[next] - 1];
+		const size_t                       home  = hash_name(entry->name, entry->length) & mask;
+		if (((next - home) & mask) >= ((next - hole) & mask)) {
+			index->names[hole] = index->names[next];
+			hole               = next;
+		}
+	}
+	index->names[hole] = 0;
+}
+
+static void
+index_free(struct index index[const static 1])
+{
+	if (index->base != NULL) {
+		munmap(index->base, (size_t)index->size);
+	}
+	free(index->entries);
+	free(index->names);
+	free(index->addrs);
+	*index = INDEX_INIT;
+}
+
+// Map the file and replay its records into the hash tables.
+// Returns 0 or an errno value.
+static int
+index_build(struct index index[const static 1], const char path[const static 1])
+{
+	struct stat stat_buffer;
+	const int   fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return errno;
+	} else if (fstat(fd, &stat_buffer) != 0) {
+		const int error = errno;
+		close(fd);
+		return error;
+	}
+
+	index->dev   = stat_buffer.st_dev;
+	index->ino   = stat_buffer.st_ino;
+	index->size  = stat_buffer.st_size;
+	index->mtime = stat_buffer.st_mtim;
+	if (index->size > 0) {
+		void *_Nullable const base = mmap(NULL, (size_t)index->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (base == MAP_FAILED) {
+			const int error = errno;
+			close(fd);
+			return error;
+		}
+		index->base = base;
+	}
+	close(fd);
+
+	size_t       capacity = 0;
+	struct valid input    = index->base == NULL ? empty : (struct valid) { .start = index->base, .end = (const char *)index->base + index->size };
+	while (!is_empty(input)) {
+		const struct split line = split_line(input);
+		input = or_empty(line.after);
+		if (index->count == capacity) {
+			capacity = capacity == 0 ? 1024 : 2 * capacity;
+			struct entry *_Nullable const entries = reallocarray(index->entries, capacity, sizeof(struct entry));
+			if (entries == NULL || capacity >= UINT32_MAX) {
+				// A failed reallocarray(3) leaves the old array allocated.
+				free(entries != NULL ? entries : index->entries);
+				index->entries = NULL;
+				return ENOMEM;
+			}
+			index->entries = entries;
+		}
+		if (parse_line(line.before, &index->entries[index->count])) {
+			index->count++;
+		}
+	}
+
+	size_t slots = 16;
+	while (slots < 2 * index->count) {
+		slots *= 2;
+	}
+	index->mask  = slots - 1;
+	index->names = calloc(slots, sizeof(uint32_t));
+	index->addrs = calloc(slots, sizeof(uint32_t));
+	if (index->names == NULL || index->addrs == NULL) {
+		return ENOMEM;
+	}
+
+	for (size_t i = 0; i < index->count; i++) {
+		struct entry *_Nonnull const entry = &index->entries[i];
+		const size_t                 slot  = name_slot(index, entry->name, entry->length);
+		const uint32_t               found = index->names[slot];
+		if (!entry->release && found == 0) {
+			index->names[slot] = (uint32_t)(i + 1);
+			entry->live        = true;
+		} else if (entry->release && found != 0 && memcmp(&index->entries[found - 1].addr, &entry->addr, sizeof(entry->addr)) == 0) {
+			index->entries[found - 1].live = false;
+			names_remove(index, slot);
+		}
+	}
+
+	// The first live mapping of an address in file order answers reverse lookups.
+	for (size_t i = 0; i < index->count; i++) {
+		const struct entry *_Nonnull const entry = &index->entries[i];
+		if (entry->live) {
+			const size_t slot = addr_slot(index, &entry->addr);
+			if (index->addrs[slot] == 0) {
+				index->addrs[slot] = (uint32_t)(i + 1);
+			}
+		}
+	}
+	return 0;
+}
+
+// Rebuild the shared index unless the file is unchanged since it was built.
+// Must be called with the index lock held. Returns 0 or an errno value.
+static int
+index_revalidate(void)
+{
+	const char *_Nullable const override = secure_getenv(NSS_ETHERS_PATH_ENV);
+	const char *_Nonnull const  path     = override != NULL ? override : NSS_ETHERS_PATH;
+	struct stat                 stat_buffer;
+
+	if (stat(path, &stat_buffer) != 0) {
+		const int error = errno;
+		index_free(&shared_index);
+		return error;
+	} else if (shared_index.names != NULL &&
+	           stat_buffer.st_dev == shared_index.dev && stat_buffer.st_ino == shared_index.ino &&
+	           stat_buffer.st_size == shared_index.size &&
+	           stat_buffer.st_mtim.tv_sec == shared_index.mtime.tv_sec && stat_buffer.st_mtim.tv_nsec == shared_index.mtime.tv_nsec) {
+		return 0;
+	}
+
+	index_free(&shared_index);
+	const int error = index_build(&shared_index, path);
+	if (error != 0) {
+		index_free(&shared_index);
+	}
+	return error;
+}
+
+// Copy an entry into the caller provided result and buffer.
+static enum nss_status
+copy_entry(const struct entry entry[const static 1], struct etherent result[const static 1], char buffer[const], const size_t length, int errnop[const static 1])
+{
+	if (length <= entry->length) {
+		*errnop = ERANGE;
+		return NSS_STATUS_TRYAGAIN;
+	}
+	memcpy(buffer, entry->name, entry->length);
+	buffer[entry->length] = '\0';
+	result->e_name = buffer;
+	result->e_addr = entry->addr;
+	return NSS_STATUS_SUCCESS;
+}
+
+NSS_EXPORT enum nss_status
+_nss_ethers_fast_gethostton_r(const char *_Nonnull name, struct etherent *_Nonnull result, char *_Nonnull buffer, size_t length, int *_Nonnull errnop)
+{
+	enum nss_status status = NSS_STATUS_NOTFOUND;
+	pthread_mutex_lock(&index_lock);
+	const int error = index_revalidate();
+	if (error != 0) {
+		*errnop = error;
+		status  = error == ENOMEM ? NSS_STATUS_TRYAGAIN : NSS_STATUS_UNAVAIL;
+	} else {
+		const uint32_t found = shared_index.names[name_slot(&shared_index, name, strlen(name))];
+		if (found != 0) {
+			status = copy_entry(&shared_index.entries[found - 1], result, buffer, length, errnop);
+		}
+	}
+	pthread_mutex_unlock(&index_lock);
+	return status;
+}
+
+NSS_EXPORT enum nss_status
+_nss_ethers_fast_getntohost_r(const struct ether_addr *_Nonnull addr, struct etherent *_Nonnull result, char *_Nonnull buffer, size_t length, int *_Nonnull errnop)
+{
+	enum nss_status status = NSS_STATUS_NOTFOUND;
+	pthread_mutex_lock(&index_lock);
+	const int error = index_revalidate();
+	if (error != 0) {
+		*errnop = error;
+		status  = error == ENOMEM ? NSS_STATUS_TRYAGAIN : NSS_STATUS_UNAVAIL;
+	} else {
+		const uint32_t found = shared_index.addrs[addr_slot(&shared_index, addr)];
+		if (found != 0) {
+			status = copy_entry(&shared_index.entries[found - 1], result, buffer, length, errnop);
+		}
+	}
+	pthread_mutex_unlock(&index_lock);
+	return status;
+}
+
+#pragma clang diagnostic pop
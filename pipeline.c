@@ -0,0 +1,314 @@
+// vim: ft=c:ts=8 :
+
+#include "pipeline.h"
+#include "ethers_file.h"
+
+// Include library headers
+#include <libxo/xo.h>
+
+// Include system headers
+#include <errno.h>
+#include <sysexits.h>
+
+#if __STDC_VERSION__ >= 202311L
+static_assert(true); // Workaround for https://github.com/clangd/clangd/issues/1167
+#endif 
+
+#pragma clang diagnostic push
+
+// Set *very* aggressive diagnostics specific to clang (version 19.1.3).
+// These diagnostics aren't stable between compiler versions.
+// If used like this they're **EXPECTED** to break break the build,
+// but they're also useful for catching errors.
+// Use `make debug` to build with these diagnostics.
+#ifdef RACONIC
+#pragma clang diagnostic error   "-Weverything"
+#pragma clang diagnostic ignored "-Wunsafe-buffer-usage"
+#pragma clang diagnostic ignored "-Wdeclaration-after-statement"
+#pragma clang diagnostic ignored "-Wpre-c11-compat"
+#pragma clang diagnostic ignored "-Wpre-c23-compat"
+#pragma clang diagnostic ignored "-Wc2y-extensions"
+#pragma clang diagnostic ignored "-Wc++98-compat"
+#pragma clang diagnostic ignored "-Wnullability-extension"
+#pragma clang diagnostic ignored "-Wvla"
+#pragma clang diagnostic ignored "-Wgnu-statement-expression"
+#pragma clang diagnostic ignored "-Wgnu-conditional-omitted-operand"
+#pragma clang diagnostic ignored "-Wgnu-case-range"
+#pragma clang diagnostic ignored "-Wgnu-designator"
+#endif
+
+_Static_assert((PIPELINE_DEPTH & (PIPELINE_DEPTH - 1)) == 0, "The pipeline depth must be a power of two");
+
+// Pipelines are allocated from an arena aligning them by their size up to a cache line (see arena_align()),
+// a plain calloc(3) wouldn't keep the ring heads and tails on their own cache lines.
+_Static_assert(alignof(struct pipeline) == CACHE_LINE_SIZE, "The rings must be aligned to a cache line");
+_Static_assert(sizeof(struct pipeline) % CACHE_LINE_SIZE == 0, "The arena must align pipelines to a cache line");
+
+static bool
+ring_push(struct ring ring[const static 1], struct batch batch[const static 1])
+{
+	const size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	const size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	if (tail - head == PIPELINE_DEPTH) {
+		return false;
+	}
+	ring->slot[tail & (PIPELINE_DEPTH - 1)] = batch;
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+	return true;
+}
+
+static struct batch *_Nullable
+ring_pop(struct ring ring[const static 1])
+{
+	const size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	const size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	if (head == tail) {
+		return NULL;
+	}
+	struct batch *_Nullable const batch = ring->slot[head & (PIPELINE_DEPTH - 1)];
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	return batch;
+}
+
+static bool
+ring_empty(struct ring ring[const static 1])
+{
+	return atomic_load_explicit(&ring->head, memory_order_relaxed) == atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+static void
+waiter_lock(struct pipeline_waiter waiter[const static 1])
+{
+	const int error = pthread_mutex_lock(&waiter->mutex);
+	if (error != 0) {
+		errno = error;
+		xo_err(EX_OSERR, "Failed to lock pipeline mutex");
+	}
+}
+
+static void
+waiter_unlock(struct pipeline_waiter waiter[const static 1])
+{
+	const int error = pthread_mutex_unlock(&waiter->mutex);
+	if (error != 0) {
+		errno = error;
+		xo_err(EX_OSERR, "Failed to unlock pipeline mutex");
+	}
+}
+
+static void
+waiter_wait(struct pipeline_waiter waiter[const static 1], pthread_cond_t cond[const static 1])
+{
+	const int error = pthread_cond_wait(cond, &waiter->mutex);
+	if (error != 0) {
+		errno = error;
+		xo_err(EX_OSERR, "Failed to wait for pipeline condition");
+	}
+}
+
+// Wait under the mutex until the ring isn't empty anymore, flagging it for the other side meanwhile.
+// The fence orders setting the flag before checking the ring and pairs with the fence in waiter_signal():
+// either the ring check sees the pushed batch or the other side sees the flag.
+static void
+waiter_await(struct pipeline_waiter waiter[const static 1], pthread_cond_t cond[const static 1], atomic_bool waiting[const static 1],
+             struct ring ring[const static 1])
+{
+	waiter_lock(waiter);
+	atomic_store_explicit(waiting, true, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	while (ring_empty(ring)) {
+		waiter_wait(waiter, cond);
+	}
+	atomic_store_explicit(waiting, false, memory_order_relaxed);
+	waiter_unlock(waiter);
+}
+
+// Wake up the other side after pushing to a ring if it flagged that it's waiting.
+// Taking the mutex to signal orders the push before the waiter's recheck of the ring under the mutex.
+static void
+waiter_signal(struct pipeline_waiter waiter[const static 1], pthread_cond_t cond[const static 1], atomic_bool waiting[const static 1])
+{
+	atomic_thread_fence(memory_order_seq_cst);
+	if (!atomic_load_explicit(waiting, memory_order_relaxed)) {
+		return;
+	}
+	waiter_lock(waiter);
+	const int error = pthread_cond_signal(cond);
+	if (error != 0) {
+		errno = error;
+		xo_err(EX_OSERR, "Failed to signal pipeline condition");
+	}
+	waiter_unlock(waiter);
+}
+
+// Both rings can hold every batch of the pipeline so pushing never has to wait.
+static void
+ring_put(struct ring ring[const static 1], struct batch batch[const static 1])
+{
+	if (!ring_push(ring, batch)) {
+		xo_errx(EX_SOFTWARE, "Pipeline ring overflow");
+	}
+}
+
+// Fill batches with the records of one file.
+// Returns false if the file failed to parse.
+static bool
+parse_file(struct pipeline pipeline[const static 1], const struct ethers_file file[const static 1])
+{
+	struct ethers_reader reader = ethers_reader_create(file);
+	reader.leases = true;
+	reader.quiet  = true; // Errors are reported by the consumer with its libxo(3) handle.
+
+	for (bool last = false; !last;) {
+		struct batch *_Nullable batch = ring_pop(&pipeline->drained);
+		if (batch == NULL) {
+			waiter_await(pipeline->waiter, &pipeline->drained_cond, &pipeline->waiting, &pipeline->drained);
+			batch = ring_pop(&pipeline->drained);
+		}
+
+		ssize_t delta = 0;
+		batch->count      = 0;
+		batch->error      = ETHERS_LINE_VALID;
+		batch->error_line = 0;
+		while (batch->count < PIPELINE_BATCH) {
+			struct batch_entry *_Nonnull const entry = &batch->entry[batch->count];
+			delta = ethers_reader_read(&reader, &entry->addr, entry->name);
+			if (delta <= 0) {
+				break;
+			}
+			entry->kind  = (int)delta;
+			entry->lease = reader.lease;
+			batch->count++;
+		}
+		if (delta < 0) {
+			batch->error      = reader.error;
+			batch->error_line = reader.line_number;
+		}
+
+		batch->last = last = batch->count < PIPELINE_BATCH || delta < 0;
+		ring_put(&pipeline->filled, batch);
+		waiter_signal(pipeline->waiter, &pipeline->waiter->filled, &pipeline->waiter->waiting);
+		if (delta < 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Parse the pipeline's files in turn, the consumer gives up on the first file failing to parse.
+static void *_Nullable
+parse_batches(void *_Nonnull const argument)
+{
+	struct pipeline *_Nonnull const pipeline = argument;
+	for (size_t i = 0; i < pipeline->count; i += pipeline->stride) {
+		if (!parse_file(pipeline, &pipeline->file[i])) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+void
+pipeline_waiter_init(struct pipeline_waiter waiter[const static 1])
+{
+	int error = pthread_mutex_init(&waiter->mutex, NULL);
+	if (error == 0) {
+		error = pthread_cond_init(&waiter->filled, NULL);
+	}
+	atomic_init(&waiter->waiting, false);
+	if (error != 0) {
+		errno = error;
+		xo_err(EX_OSERR, "Failed to initialise pipeline waiter");
+	}
+}
+
+void
+pipeline_waiter_destroy(struct pipeline_waiter waiter[const static 1])
+{
+	if (pthread_cond_destroy(&waiter->filled) != 0 || pthread_mutex_destroy(&waiter->mutex) != 0) {
+		xo_errx(EX_SOFTWARE, "Failed to destroy pipeline waiter");
+	}
+}
+
+// Start parsing the files file[0], file[stride], ... below file[count] on a new thread.
+// The batches are allocated from the arena before the thread starts.
+void
+pipeline_start(struct pipeline pipeline[const static 1], const struct ethers_file file[const], const size_t count, const size_t stride,
+               struct arena arena[const static 1], struct pipeline_waiter waiter[const static 1])
+{
+	pipeline->file    = file;
+	pipeline->count   = count;
+	pipeline->stride  = stride;
+	pipeline->waiter  = waiter;
+	pipeline->batches = arena_alloc(arena, PIPELINE_DEPTH, sizeof(struct batch));
+	const int cond_error = pthread_cond_init(&pipeline->drained_cond, NULL);
+	if (cond_error != 0) {
+		errno = cond_error;
+		xo_err(EX_OSERR, "Failed to initialise pipeline condition for '%s'", file[0].path);
+	}
+	atomic_init(&pipeline->filled.head, 0);
+	atomic_init(&pipeline->filled.tail, 0);
+	atomic_init(&pipeline->drained.head, 0);
+	atomic_init(&pipeline->drained.tail, 0);
+	atomic_init(&pipeline->waiting, false);
+	for (size_t i = 0; i < PIPELINE_DEPTH; i++) {
+		ring_put(&pipeline->drained, &pipeline->batches[i]);
+	}
+
+	const int error = pthread_create(&pipeline->thread, NULL, parse_batches, pipeline);
+	if (error != 0) {
+		errno = error;
+		xo_err(EX_OSERR, "Failed to create parser thread for '%s'", file[0].path);
+	}
+}
+
+// Return the next filled batch or NULL if the parser hasn't filled one yet.
+// The batch with the last flag set is the final batch of a file, the next batch belongs to the pipeline's next file.
+struct batch *_Nullable
+pipeline_poll(struct pipeline pipeline[const static 1])
+{
+	return ring_pop(&pipeline->filled);
+}
+
+// Block until one of the pipelines has a filled batch.
+// Finished pipelines never fill another batch, at least one of them must still be running.
+void
+pipeline_wait(struct pipeline_waiter waiter[const static 1], struct pipeline pipelines[const], const size_t count)
+{
+	waiter_lock(waiter);
+	atomic_store_explicit(&waiter->waiting, true, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	for (;;) {
+		for (size_t i = 0; i < count; i++) {
+			if (!ring_empty(&pipelines[i].filled)) {
+				atomic_store_explicit(&waiter->waiting, false, memory_order_relaxed);
+				waiter_unlock(waiter);
+				return;
+			}
+		}
+		waiter_wait(waiter, &waiter->filled);
+	}
+}
+
+// Hand a consumed batch back to the parser.
+void
+pipeline_done(struct pipeline pipeline[const static 1], struct batch batch[const static 1])
+{
+	ring_put(&pipeline->drained, batch);
+	waiter_signal(pipeline->waiter, &pipeline->drained_cond, &pipeline->waiting);
+}
+
+// Wait for the parser to finish.
+void
+pipeline_join(struct pipeline pipeline[const static 1])
+{
+	const int error = pthread_join(pipeline->thread, NULL);
+	if (error != 0) {
+		errno = error;
+		xo_err(EX_OSERR, "Failed to join parser thread for '%s'", pipeline->file[0].path);
+	} else if (pthread_cond_destroy(&pipeline->drained_cond) != 0) {
+		xo_errx(EX_SOFTWARE, "Failed to destroy pipeline condition for '%s'", pipeline->file[0].path);
+	}
+}
+
+#pragma clang diagnostic pop
@@ -0,0 +1,115 @@
+// vim: ft=c:ts=8 :
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <sys/param.h>
+#include <net/ethernet.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "arena.h"
+#include "ethers_file.h"
+
+#if __STDC_VERSION__ >= 202311L
+static_assert(true); // Workaround for https://github.com/clangd/clangd/issues/1167
+#endif 
+
+#pragma clang diagnostic push
+
+// Set *very* aggressive diagnostics specific to clang (version 19.1.3).
+// These diagnostics aren't stable between compiler versions.
+// If used like this they're **EXPECTED** to break break the build,
+// but they're also useful for catching errors.
+// Use `make debug` to build with these diagnostics.
+#ifdef RACONIC
+#pragma clang diagnostic error   "-Weverything"
+#pragma clang diagnostic ignored "-Wunsafe-buffer-usage"
+#pragma clang diagnostic ignored "-Wdeclaration-after-statement"
+#pragma clang diagnostic ignored "-Wpre-c11-compat"
+#pragma clang diagnostic ignored "-Wpre-c23-compat"
+#pragma clang diagnostic ignored "-Wc2y-extensions"
+#pragma clang diagnostic ignored "-Wc++98-compat"
+#pragma clang diagnostic ignored "-Wnullability-extension"
+#pragma clang diagnostic ignored "-Wvla"
+#pragma clang diagnostic ignored "-Wgnu-statement-expression"
+#pragma clang diagnostic ignored "-Wgnu-conditional-omitted-operand"
+#pragma clang diagnostic ignored "-Wgnu-case-range"
+#pragma clang diagnostic ignored "-Wgnu-designator"
+#endif
+
+// Records are parsed in batches to amortise the ring traffic over many lines.
+#define PIPELINE_BATCH 512
+
+// Number of batches in flight per file (a power of two).
+#define PIPELINE_DEPTH 8
+
+// The kind of record (see ethers_reader_read()) and the lease details of lease records.
+struct batch_entry {
+	struct ether_addr   addr;
+	int                 kind;
+	struct ethers_lease lease;
+	char                name[MAXHOSTNAMELEN];
+};
+
+// The last flag marks the last batch of each file.
+// A batch failing to parse is the last batch and reports the error (ETHERS_LINE_*)
+// and its line number for the consumer to warn about.
+struct batch {
+	size_t             count;
+	bool               last;
+	int                error;
+	size_t             error_line;
+	struct batch_entry entry[PIPELINE_BATCH];
+};
+
+// A lock-free single-producer/single-consumer ring of batch pointers.
+// The head is only written by the consumer and the tail only by the producer
+// each on its own cache line.
+struct ring {
+	alignas(CACHE_LINE_SIZE) atomic_size_t head;
+	alignas(CACHE_LINE_SIZE) atomic_size_t tail;
+	struct batch *_Nullable                slot[PIPELINE_DEPTH];
+};
+
+// Blocks the consumer of several pipelines until any of them filled a batch.
+// The parsers wait for drained batches under the same mutex.
+// Each side flags when it's about to wait so the other side only takes the mutex to signal it then.
+struct pipeline_waiter {
+	pthread_mutex_t mutex;
+	pthread_cond_t  filled;
+	atomic_bool     waiting;
+};
+
+// A parser thread filling batches with the records of every <stride>th of <count> ethers files in turn.
+// Filled batches are passed to the consumer through the filled ring
+// and handed back to the parser through the drained ring once consumed.
+// Either side only blocks on the waiter if its ring is empty.
+// The pipeline must not be moved between pipeline_start() and pipeline_join().
+struct pipeline {
+	const struct ethers_file      *_Nonnull  file;
+	size_t                                   count;
+	size_t                                   stride;
+	struct batch                  *_Nullable batches;
+	struct pipeline_waiter        *_Nonnull  waiter;
+	struct ring                              filled;
+	struct ring                              drained;
+	pthread_cond_t                           drained_cond;
+	atomic_bool                              waiting;
+	pthread_t                                thread;
+};
+
+void                  pipeline_waiter_init(struct pipeline_waiter waiter[const static 1]);
+void                  pipeline_waiter_destroy(struct pipeline_waiter waiter[const static 1]);
+void                  pipeline_start(struct pipeline pipeline[const static 1], const struct ethers_file file[const], size_t count, size_t stride,
+                                     struct arena arena[const static 1], struct pipeline_waiter waiter[const static 1]);
+struct batch *_Nullable pipeline_poll(struct pipeline pipeline[const static 1]);
+void                  pipeline_wait(struct pipeline_waiter waiter[const static 1], struct pipeline pipelines[const], size_t count);
+void                  pipeline_done(struct pipeline pipeline[const static 1], struct batch batch[const static 1]);
+void                  pipeline_join(struct pipeline pipeline[const static 1]);
+
+#pragma clang diagnostic pop
+#endif /* PIPELINE_H */
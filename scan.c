@@ -3,6 +3,7 @@
 // Include system headers from subdirectories.
 #include <net/ethernet.h>
 #include <limits.h>
+#include <stdint.h>
 
 #include "slice.h"
 #include "scan.h"
@@ -81,8 +82,10 @@ scan_octet(struct valid input, uint8_t byte[const static 1])
 	return scan_hexdigit(input, byte);
 }
 
-static struct maybe
-scan_octet_colon(struct valid input, uint8_t byte[const static 1])
+// Scan an octet followed by a separator.
+// Always inlined with a constant separator to specialize the parser for each notation.
+static inline __attribute__((always_inline)) struct maybe
+scan_octet_separator(struct valid input, uint8_t byte[const static 1], const char separator)
 {
 	struct maybe maybe = scan_octet(input, byte);
 	if (is_null(maybe)) {
@@ -91,7 +94,7 @@ scan_octet_colon(struct valid input, uint8_t byte[const static 1])
 		input = or_empty(maybe);
 	}
 
-	maybe = scan_literal(input, ':');
+	maybe = scan_literal(input, separator);
 	if (is_null(maybe)) {
 		return maybe;
 	} else {
@@ -101,7 +104,62 @@ scan_octet_colon(struct valid input, uint8_t byte[const static 1])
 	return input.maybe;
 }
 
-static struct valid
+// Scan six octets separated by the separator (e.g. "aa:bb:cc:dd:ee:ff" or "aa-bb-cc-dd-ee-ff").
+static inline __attribute__((always_inline)) struct maybe
+scan_addr_separated(struct valid input, struct ether_addr addr[const static 1], const char separator)
+{
+	for (size_t i = 0; i < 5; i++) {
+		uint8_t *_Nonnull const octet = &ETHER_OCTETS(addr)[i];
+		const struct maybe maybe = scan_octet_separator(input, octet, separator);
+		if (is_null(maybe)) {
+			return maybe;
+		} else {
+			input = or_empty(maybe);
+		}
+	}
+	uint8_t *_Nonnull const octet = &ETHER_OCTETS(addr)[5];
+	return scan_octet(input, octet);
+}
+
+// Scan three groups of two octets separated by dots ("aabb.ccdd.eeff").
+static struct maybe
+scan_addr_dotted(struct valid input, struct ether_addr addr[const static 1])
+{
+	for (size_t i = 0; i < 6; i += 2) {
+		struct maybe maybe = scan_octet(input, &ETHER_OCTETS(addr)[i]);
+		if (is_null(maybe)) {
+			return maybe;
+		} else if (i < 4) {
+			maybe = scan_octet_separator(or_empty(maybe), &ETHER_OCTETS(addr)[i + 1], '.');
+		} else {
+			maybe = scan_octet(or_empty(maybe), &ETHER_OCTETS(addr)[i + 1]);
+		}
+		if (is_null(maybe)) {
+			return maybe;
+		} else {
+			input = or_empty(maybe);
+		}
+	}
+	return input.maybe;
+}
+
+// Scan twelve hex digits without separators ("aabbccddeeff").
+static struct maybe
+scan_addr_bare(struct valid input, struct ether_addr addr[const static 1])
+{
+	for (size_t i = 0; i < 6; i++) {
+		const struct maybe maybe = scan_octet(input, &ETHER_OCTETS(addr)[i]);
+		if (is_null(maybe)) {
+			return maybe;
+		} else {
+			input = or_empty(maybe);
+		}
+	}
+	return input.maybe;
+}
+
+// Skip the whitespace (including new lines) at the start of the input.
+struct valid
 trim_left_whitespace(struct valid valid)
 {
 	for (; valid.start != valid.end; valid.start++) {
@@ -113,21 +171,22 @@ trim_left_whitespace(struct valid valid)
 	return valid;
 }
 
+// Scan a MAC address in colon separated (canonical), dash separated,
+// dotted (Cisco) or bare notation. The notation is chosen by the first separator.
 struct maybe
 scan_addr(struct valid input, struct ether_addr addr[const static 1])
 {
 	input = trim_left_whitespace(input);
-	for (size_t i = 0; i < 5; i++) {
-		uint8_t *_Nonnull const octet = &addr->octet[i];
-		const struct maybe maybe = scan_octet_colon(input, octet);
-		if (is_null(maybe)) {
-			return maybe;
-		} else {
-			input = or_empty(maybe);
-		}
+	const size_t length = valid_length(input);
+	if (length > 2 && input.start[2] == ':') {
+		return scan_addr_separated(input, addr, ':');
+	} else if (length > 2 && input.start[2] == '-') {
+		return scan_addr_separated(input, addr, '-');
+	} else if (length > 4 && input.start[4] == '.') {
+		return scan_addr_dotted(input, addr);
+	} else {
+		return scan_addr_bare(input, addr);
 	}
-	uint8_t *_Nonnull const octet = &addr->octet[5];
-	return scan_octet(input, octet);
 }
 
 struct maybe
@@ -163,4 +222,25 @@ scan_name(struct valid input, struct maybe name[const static 1])
 	return input.maybe;
 }
 
+// Scan an unsigned decimal number without sign or overflow.
+struct maybe
+scan_count(struct valid input, uint64_t value[const static 1])
+{
+	input = trim_left_whitespace(input);
+	if (is_empty(input) || input.start[0] < '0' || input.start[0] > '9') {
+		return none;
+	}
+
+	uint64_t count = 0;
+	for (; input.start != input.end && input.start[0] >= '0' && input.start[0] <= '9'; input.start++) {
+		const uint64_t digit = (uint64_t)(input.start[0] - '0');
+		if (count > (UINT64_MAX - digit) / 10) {
+			return none;
+		}
+		count = 10 * count + digit;
+	}
+	*value = count;
+	return input.maybe;
+}
+
 #pragma clang diagnostic pop
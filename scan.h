@@ -3,6 +3,7 @@
 // Include system headers from subdirectories.
 #include <net/ethernet.h>
 #include <limits.h>
+#include <stdint.h>
 
 #include "slice.h"
 
@@ -33,7 +34,16 @@ static_assert(true); // Workaround for https://github.com/clangd/clangd/issues/1
 #pragma clang diagnostic ignored "-Wgnu-designator"
 #endif
 
+// glibc names the octets of a struct ether_addr ether_addr_octet instead of octet.
+#ifdef __GLIBC__
+#define ETHER_OCTETS(addr) ((addr)->ether_addr_octet)
+#else
+#define ETHER_OCTETS(addr) ((addr)->octet)
+#endif
+
+struct valid trim_left_whitespace(struct valid valid);
 struct maybe scan_addr(struct valid input, struct ether_addr addr[const static 1]);
 struct maybe scan_name(struct valid input, struct maybe name[const static 1]);
+struct maybe scan_count(struct valid input, uint64_t value[const static 1]);
 
 #pragma clang diagnostic pop
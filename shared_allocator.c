@@ -0,0 +1,376 @@
+// vim: ft=c:ts=8 :
+
+#include "allocator.h"
+#include "arena.h"
+#include "compact.h"
+#include "ethers_file.h"
+#include "lease.h"
+#include "shared_allocator.h"
+
+// Include system headers from subdirectories.
+#include <libxo/xo.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+
+// Include system headers
+#include <fcntl.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#if __STDC_VERSION__ >= 202311L
+static_assert(true); // Workaround for https://github.com/clangd/clangd/issues/1167
+#endif 
+
+#pragma clang diagnostic push
+
+// Set *very* aggressive diagnostics specific to clang (version 19.1.3).
+// These diagnostics aren't stable between compiler versions.
+// If used like this they're **EXPECTED** to break break the build,
+// but they're also useful for catching errors.
+// Use `make debug` to build with these diagnostics.
+#ifdef RACONIC
+#pragma clang diagnostic error   "-Weverything"
+#pragma clang diagnostic ignored "-Wunsafe-buffer-usage"
+#pragma clang diagnostic ignored "-Wdeclaration-after-statement"
+#pragma clang diagnostic ignored "-Wpre-c11-compat"
+#pragma clang diagnostic ignored "-Wpre-c23-compat"
+#pragma clang diagnostic ignored "-Wc2y-extensions"
+#pragma clang diagnostic ignored "-Wc++98-compat"
+#pragma clang diagnostic ignored "-Wnullability-extension"
+#pragma clang diagnostic ignored "-Wvla"
+#pragma clang diagnostic ignored "-Wgnu-statement-expression"
+#pragma clang diagnostic ignored "-Wgnu-conditional-omitted-operand"
+#pragma clang diagnostic ignored "-Wgnu-case-range"
+#pragma clang diagnostic ignored "-Wgnu-designator"
+#endif
+
+#define WORD_BITS 64
+
+// The bitmap of ethers/local is ethers/.local.bitmap.
+static void
+shared_path(const char path[const static 1], char bitmap[const static PATH_MAX])
+{
+	const size_t size = strlen(path) + 1;
+	char         dir_copy[PATH_MAX];
+	char         base_copy[PATH_MAX];
+
+	memcpy(dir_copy, path, size);
+	memcpy(base_copy, path, size);
+	const char *_Nonnull const dir_path  = dirname(dir_copy);
+	const char *_Nonnull const base_path = basename(base_copy);
+
+	const int length = snprintf(bitmap, PATH_MAX, "%s/.%s" SHARED_ALLOCATOR_SUFFIX, dir_path, base_path);
+	if (length < 0 || length >= PATH_MAX) {
+		xo_errx(EX_CONFIG, "The shared allocator bitmap path for ethers file '%s' is too long", path);
+	}
+}
+
+static void
+shared_map(struct shared_allocator shared[const static 1])
+{
+	void *_Nullable const addr = mmap(NULL, shared->length, PROT_READ | PROT_WRITE, MAP_SHARED, shared->fd, 0);
+	if (addr == MAP_FAILED) {
+		xo_err(EX_IOERR, "Failed to mmap() %zu byte shared allocator bitmap", shared->length);
+	}
+	shared->header = addr;
+	shared->words  = (_Atomic uint64_t *)(void *)((char *)addr + SHARED_ALLOCATOR_HEADER_SIZE);
+}
+
+static void
+shared_unmap(struct shared_allocator shared[const static 1])
+{
+	if (shared->header != NULL && munmap(shared->header, shared->length) != 0) {
+		xo_err(EX_IOERR, "Failed to munmap() shared allocator bitmap");
+	}
+	shared->header = NULL;
+	shared->words  = NULL;
+}
+
+// The bitmap is current if it covers the same range and every byte of the same ethers file.
+// Maps the bitmap unless it has the wrong size.
+static bool
+shared_current(struct shared_allocator shared[const static 1], const struct ethers_file file[const static 1],
+               const uint64_t offset, const uint64_t size)
+{
+	struct stat bitmap_stat;
+	struct stat file_stat;
+	if (fstat(shared->fd, &bitmap_stat) != 0 || fstat(file->fd, &file_stat) != 0) {
+		xo_err(EX_IOERR, "Failed to fstat() shared allocator bitmap of ethers file '%s'", file->path);
+	} else if ((uint64_t)bitmap_stat.st_size != shared->length) {
+		return false;
+	}
+
+	shared_map(shared);
+	const struct shared_header *_Nonnull const header = shared->header;
+	return !memcmp(header->magic, SHARED_ALLOCATOR_MAGIC, sizeof(header->magic)) &&
+	       header->version     == SHARED_ALLOCATOR_VERSION &&
+	       header->header_size == SHARED_ALLOCATOR_HEADER_SIZE &&
+	       header->offset      == offset &&
+	       header->size        == size &&
+	       header->dev         == (uint64_t)file_stat.st_dev &&
+	       header->ino         == (uint64_t)file_stat.st_ino &&
+	       atomic_load_explicit(&header->generation, memory_order_acquire) == (uint64_t)file_stat.st_size;
+}
+
+static int
+compare_addr_sequence(const void *_Nonnull const a, const void *_Nonnull const b)
+{
+	const struct record *_Nonnull const left  = a;
+	const struct record *_Nonnull const right = b;
+	const int order = memcmp(&left->addr, &right->addr, sizeof(left->addr));
+	return order != 0 ? order : (left->sequence > right->sequence) - (left->sequence < right->sequence);
+}
+
+static void
+shared_claim(const struct shared_allocator shared[const static 1], const uint64_t offset, const uint64_t size, const uint64_t addr)
+{
+	const uint64_t position = addr - offset;
+	if (addr >= offset && position < size) {
+		atomic_fetch_or_explicit(&shared->words[position / WORD_BITS], UINT64_C(1) << (position % WORD_BITS), memory_order_relaxed);
+	}
+}
+
+// Rebuild the bitmap from the ethers file with the same rules as the private allocator:
+// the last record of each address decides if it's claimed and live leases are claimed as a whole.
+// The caller holds the exclusive lock on the bitmap and the shared lock on the ethers file
+// so neither the bitmap nor the ethers file can change meanwhile.
+static void
+shared_rebuild(struct shared_allocator shared[const static 1], const struct ethers_file file[const static 1],
+               const uint64_t offset, const uint64_t size)
+{
+	struct stat file_stat;
+	if (fstat(file->fd, &file_stat) != 0) {
+		xo_err(EX_IOERR, "Failed to fstat() ethers file '%s'", file->path);
+	}
+
+	// Truncating first zeroes the bitmap without touching every page and clears the magic until the rebuild is done.
+	if (ftruncate(shared->fd, 0) != 0 || ftruncate(shared->fd, (off_t)shared->length) != 0) {
+		xo_err(EX_IOERR, "Failed to ftruncate() shared allocator bitmap of ethers file '%s'", file->path);
+	}
+	shared_map(shared);
+
+	struct arena         arena   __attribute__((cleanup(arena_cleanup))) = ARENA_INIT;
+	struct records       records = RECORDS_INIT(&arena);
+	const struct valid   map     = ethers_mmap(file->fd, file->path);
+	struct ethers_reader reader  = ethers_reader_create(file);
+	reader.input = map;
+	read_records(&records, &reader);
+
+	struct record *_Nullable const record = records.record;
+	if (record != NULL) {
+		qsort(record, records.count, sizeof(struct record), compare_addr_sequence);
+	}
+	for (size_t i = 0; i < records.count; i++) {
+		const bool last = i + 1 == records.count || memcmp(&record[i].addr, &record[i + 1].addr, sizeof(record[i].addr)) != 0;
+		if (last && !record[i].release) {
+			shared_claim(shared, offset, size, addr_to_u64(record[i].addr));
+		}
+	}
+
+	const uint64_t now = (uint64_t)time(NULL);
+	for (size_t i = 0; i < records.leases.count; i++) {
+		const struct lease *_Nonnull const lease = &records.leases.lease[i];
+		const uint64_t                     first = addr_to_u64(lease->first);
+		for (uint64_t index = 0; lease_live(lease, now) && index < lease->count; index++) {
+			shared_claim(shared, offset, size, first + index);
+		}
+	}
+
+	// Mark the padding after the last address as used.
+	if (size % WORD_BITS != 0) {
+		atomic_fetch_or_explicit(&shared->words[size / WORD_BITS], ~UINT64_C(0) << (size % WORD_BITS), memory_order_relaxed);
+	}
+
+	uint64_t hint = 0;
+	while (hint < shared->count && atomic_load_explicit(&shared->words[hint], memory_order_relaxed) == ~UINT64_C(0)) {
+		hint++;
+	}
+
+	struct shared_header *_Nonnull const header = shared->header;
+	header->version     = SHARED_ALLOCATOR_VERSION;
+	header->header_size = SHARED_ALLOCATOR_HEADER_SIZE;
+	header->offset      = offset;
+	header->size        = size;
+	header->dev         = (uint64_t)file_stat.st_dev;
+	header->ino         = (uint64_t)file_stat.st_ino;
+	atomic_store_explicit(&header->hint, hint, memory_order_relaxed);
+	atomic_store_explicit(&header->generation, (uint64_t)file_stat.st_size, memory_order_release);
+	memcpy(header->magic, SHARED_ALLOCATOR_MAGIC, sizeof(header->magic));
+
+	ethers_unmap(map);
+}
+
+// Map the shared bitmap next to the ethers file, rebuilding it if it doesn't cover the whole file.
+// Checking the generation under the shared bitmap lock is racy while other writers are between appending and committing,
+// so a mismatch is checked again under the exclusive bitmap lock which waits for them to finish.
+struct shared_allocator
+shared_allocator_open(const struct ethers_file file[const static 1], const struct ether_addr min, const struct ether_addr max)
+{
+	const uint64_t offset = addr_to_u64(min);
+	const uint64_t size   = addr_to_u64(max) - offset;
+	const uint64_t count  = (size + WORD_BITS - 1) / WORD_BITS;
+	if (count > (SIZE_MAX - SHARED_ALLOCATOR_HEADER_SIZE) / sizeof(uint64_t)) {
+		xo_errx(EX_SOFTWARE, "Address space too small for %" PRIu64 " bit shared bitmap.", size);
+	}
+
+	char path[PATH_MAX];
+	shared_path(file->path, path);
+	struct shared_allocator shared = {
+		.header = NULL,
+		.words  = NULL,
+		.count  = count,
+		.length = SHARED_ALLOCATOR_HEADER_SIZE + (size_t)count * sizeof(uint64_t),
+		.fd     = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)
+	};
+	if (shared.fd < 0) {
+		xo_err(EX_CANTCREAT, "Failed to open shared allocator bitmap '%s'", path);
+	} else if (flock(shared.fd, LOCK_SH) != 0) {
+		xo_err(EX_IOERR, "Failed to lock shared allocator bitmap '%s'", path);
+	} else if (shared_current(&shared, file, offset, size)) {
+		return shared;
+	}
+
+	shared_unmap(&shared);
+	if (flock(shared.fd, LOCK_EX) != 0) {
+		xo_err(EX_IOERR, "Failed to lock shared allocator bitmap '%s' for rebuilding", path);
+	} else if (!shared_current(&shared, file, offset, size)) {
+		shared_unmap(&shared);
+		shared_rebuild(&shared, file, offset, size);
+	}
+	if (flock(shared.fd, LOCK_SH) != 0) {
+		xo_err(EX_IOERR, "Failed to downgrade shared allocator bitmap lock '%s'", path);
+	}
+	return shared;
+}
+
+void
+shared_allocator_cleanup(struct shared_allocator shared[const static 1])
+{
+	shared_unmap(shared);
+	if (shared->fd >= 0 && close(shared->fd) != 0) {
+		xo_err(EX_IOERR, "Failed to close() shared allocator bitmap");
+	}
+	shared->fd = -1;
+}
+
+// Move the hint past a full word unless another process already did.
+static void
+shared_skip(const struct shared_allocator shared[const static 1], uint64_t word)
+{
+	atomic_compare_exchange_strong_explicit(&shared->header->hint, &word, word + 1, memory_order_relaxed, memory_order_relaxed);
+}
+
+// Claim the lowest free address at or after the hint with a compare and swap on its word.
+bool
+shared_allocator_alloc(const struct shared_allocator shared[const static 1], struct ether_addr addr[const static 1])
+{
+	_Atomic uint64_t *_Nonnull const words = shared->words;
+	for (uint64_t word = atomic_load_explicit(&shared->header->hint, memory_order_relaxed); word < shared->count; word++) {
+		uint64_t bits = atomic_load_explicit(&words[word], memory_order_relaxed);
+		while (bits != ~UINT64_C(0)) {
+			const uint64_t bit = ~bits & (bits + 1);
+			if (atomic_compare_exchange_weak_explicit(&words[word], &bits, bits | bit, memory_order_acq_rel, memory_order_relaxed)) {
+				if ((bits | bit) == ~UINT64_C(0)) {
+					shared_skip(shared, word);
+				}
+				*addr = u64_to_addr(shared->header->offset + word * WORD_BITS + (uint64_t)__builtin_ctzll(bit));
+				return true;
+			}
+		}
+		shared_skip(shared, word);
+	}
+	return false;
+}
+
+// Claim an aligned block of 2^order addresses.
+// Blocks within a word are claimed with a single compare and swap,
+// larger blocks claim their free words one at a time and give them back if another process got in first.
+bool
+shared_allocator_alloc_block(const struct shared_allocator shared[const static 1], const unsigned order, struct ether_addr addr[const static 1])
+{
+	_Atomic uint64_t *_Nonnull const words = shared->words;
+	const uint64_t                   hint  = atomic_load_explicit(&shared->header->hint, memory_order_relaxed);
+	if (order < 6) {
+		const uint64_t width = UINT64_C(1) << order;
+		const uint64_t mask  = (UINT64_C(1) << width) - 1;
+		for (uint64_t word = hint; word < shared->count; word++) {
+			uint64_t bits  = atomic_load_explicit(&words[word], memory_order_relaxed);
+			uint64_t shift = 0;
+			while (shift < WORD_BITS) {
+				if ((bits & mask << shift) != 0) {
+					shift += width;
+				} else if (atomic_compare_exchange_strong_explicit(&words[word], &bits, bits | mask << shift,
+				                                                   memory_order_acq_rel, memory_order_relaxed)) {
+					*addr = u64_to_addr(shared->header->offset + word * WORD_BITS + shift);
+					return true;
+				} else {
+					shift = 0; // Rescan the word reloaded by the failed compare and swap.
+				}
+			}
+		}
+		return false;
+	}
+
+	const uint64_t span = UINT64_C(1) << (order - 6);
+	for (uint64_t first = roundup2(hint, span); first < shared->count && span <= shared->count - first; first += span) {
+		uint64_t claimed = 0;
+		for (uint64_t zero = 0; claimed < span; claimed++, zero = 0) {
+			if (!atomic_compare_exchange_strong_explicit(&words[first + claimed], &zero, ~UINT64_C(0), memory_order_acq_rel, memory_order_relaxed)) {
+				break;
+			}
+		}
+		if (claimed == span) {
+			*addr = u64_to_addr(shared->header->offset + first * WORD_BITS);
+			return true;
+		}
+		while (claimed-- > 0) {
+			atomic_store_explicit(&words[first + claimed], 0, memory_order_release);
+		}
+	}
+	return false;
+}
+
+// Give back an aligned block of 2^order addresses claimed by this process (order 0 for a single address).
+// Only its own bits are cleared, other processes may have claimed the rest of the word since.
+// The hint moves back if it already skipped the block.
+void
+shared_allocator_free(const struct shared_allocator shared[const static 1], const unsigned order, const struct ether_addr addr)
+{
+	_Atomic uint64_t *_Nonnull const words    = shared->words;
+	const uint64_t                   position = addr_to_u64(addr) - shared->header->offset;
+	const uint64_t                   first    = position / WORD_BITS;
+	if (order < 6) {
+		const uint64_t mask = ((UINT64_C(1) << (UINT64_C(1) << order)) - 1) << (position % WORD_BITS);
+		atomic_fetch_and_explicit(&words[first], ~mask, memory_order_release);
+	} else {
+		for (uint64_t word = first; word < first + (UINT64_C(1) << (order - 6)); word++) {
+			atomic_store_explicit(&words[word], 0, memory_order_release);
+		}
+	}
+
+	uint64_t hint = atomic_load_explicit(&shared->header->hint, memory_order_relaxed);
+	while (first < hint && !atomic_compare_exchange_weak_explicit(&shared->header->hint, &hint, first, memory_order_relaxed, memory_order_relaxed)) {
+	}
+}
+
+// Advance the generation by the bytes appended to the ethers file.
+void
+shared_allocator_commit(const struct shared_allocator shared[const static 1], const uint64_t written)
+{
+	if (shared->header != NULL) {
+		atomic_fetch_add_explicit(&shared->header->generation, written, memory_order_release);
+	}
+}
+
+#pragma clang diagnostic pop
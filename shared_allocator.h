@@ -0,0 +1,85 @@
+// vim: ft=c:ts=8 :
+
+#ifndef SHARED_ALLOCATOR_H
+#define SHARED_ALLOCATOR_H
+
+#include <net/ethernet.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ethers_file.h"
+
+#if __STDC_VERSION__ >= 202311L
+static_assert(true); // Workaround for https://github.com/clangd/clangd/issues/1167
+#endif
+
+#pragma clang diagnostic push
+
+// Set *very* aggressive diagnostics specific to clang (version 19.1.3).
+// These diagnostics aren't stable between compiler versions.
+// If used like this they're **EXPECTED** to break break the build,
+// but they're also useful for catching errors.
+// Use `make debug` to build with these diagnostics.
+#ifdef RACONIC
+#pragma clang diagnostic error   "-Weverything"
+#pragma clang diagnostic ignored "-Wunsafe-buffer-usage"
+#pragma clang diagnostic ignored "-Wdeclaration-after-statement"
+#pragma clang diagnostic ignored "-Wpre-c11-compat"
+#pragma clang diagnostic ignored "-Wpre-c23-compat"
+#pragma clang diagnostic ignored "-Wc2y-extensions"
+#pragma clang diagnostic ignored "-Wc++98-compat"
+#pragma clang diagnostic ignored "-Wnullability-extension"
+#pragma clang diagnostic ignored "-Wvla"
+#pragma clang diagnostic ignored "-Wgnu-statement-expression"
+#pragma clang diagnostic ignored "-Wgnu-conditional-omitted-operand"
+#pragma clang diagnostic ignored "-Wgnu-case-range"
+#pragma clang diagnostic ignored "-Wgnu-designator"
+#endif
+
+// The shared bitmap lives in a dot file next to the ethers file (ignored as a shard).
+#define SHARED_ALLOCATOR_SUFFIX ".bitmap"
+#define SHARED_ALLOCATOR_MAGIC  "ETHERSBM"
+#define SHARED_ALLOCATOR_VERSION 1
+
+// The header fills the first page so the words after it stay page aligned.
+// It's only ever shared between processes on the same machine so it uses the native byte order.
+// The size of the ethers file covered by the bitmap is its generation: writers add the length of their appended lines
+// after writing them so any other append (or a crash in between) leaves the generation behind the file and forces a rebuild.
+#define SHARED_ALLOCATOR_HEADER_SIZE 4096
+
+struct shared_header {
+	char             magic[sizeof(SHARED_ALLOCATOR_MAGIC) - 1];
+	uint32_t         version;
+	uint32_t         header_size;
+	uint64_t         offset;
+	uint64_t         size;
+	uint64_t         dev;
+	uint64_t         ino;
+	_Atomic uint64_t generation;
+	_Atomic uint64_t hint;
+};
+
+// A mapping of the shared bitmap. Bit i of word j is set if offset + 64 * j + i is claimed.
+// The bitmap file stays locked shared (or exclusive while rebuilding) as long as it's mapped.
+struct shared_allocator {
+	struct shared_header *_Nullable header;
+	_Atomic uint64_t     *_Nullable words;
+	uint64_t                        count;
+	size_t                          length;
+	int                             fd;
+};
+
+#define SHARED_ALLOCATOR_NONE ((struct shared_allocator) { .header = NULL, .words = NULL, .count = 0, .length = 0, .fd = -1 })
+
+struct shared_allocator shared_allocator_open(const struct ethers_file file[const static 1], struct ether_addr min, struct ether_addr max);
+void                    shared_allocator_cleanup(struct shared_allocator shared[const static 1]);
+bool                    shared_allocator_alloc(const struct shared_allocator shared[const static 1], struct ether_addr addr[const static 1]);
+bool                    shared_allocator_alloc_block(const struct shared_allocator shared[const static 1], unsigned order,
+                                                     struct ether_addr addr[const static 1]);
+void                    shared_allocator_free(const struct shared_allocator shared[const static 1], unsigned order, struct ether_addr addr);
+void                    shared_allocator_commit(const struct shared_allocator shared[const static 1], uint64_t written);
+
+#pragma clang diagnostic pop
+#endif /* SHARED_ALLOCATOR_H */
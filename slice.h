@@ -34,6 +34,12 @@ static_assert(true); // Workaround for https://github.com/clangd/clangd/issues/1
 #pragma clang diagnostic ignored "-Wgnu-designator"
 #endif
 
+// Only clang knows the nullability qualifiers (e.g. GCC building the nss(5) module on glibc).
+#ifndef __clang__
+#define _Nonnull
+#define _Nullable
+#endif
+
 struct valid {
 	union {
 		struct {
@@ -88,6 +94,16 @@ or_empty(const struct maybe maybe)
 	return is_valid(maybe) ? VALID((const char *_Nonnull)maybe.start, (const char *_Nonnull)maybe.end) : empty;
 }
 
+// Compare like strcmp(3) without relying on NUL terminators (a slice sorts before the longer slices it prefixes).
+static inline int
+valid_compare(const struct valid a, const struct valid b)
+{
+	const size_t a_length = valid_length(a);
+	const size_t b_length = valid_length(b);
+	const int    order    = memcmp(a.start, b.start, a_length < b_length ? a_length : b_length);
+	return order != 0 ? order : (a_length > b_length) - (a_length < b_length);
+}
+
 static inline struct valid
 valid_string(const char string[const static 1])
 {
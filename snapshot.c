@@ -0,0 +1,185 @@
+// vim: ft=c:ts=8 :
+
+#include "arena.h"
+#include "compact.h"
+#include "ethers_file.h"
+#include "snapshot.h"
+
+// Include library headers
+#include <libxo/xo.h>
+
+// Include system headers from subdirectories.
+#include <net/ethernet.h>
+#include <sys/endian.h>
+#include <sys/param.h>
+
+// Include system headers
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+#if __STDC_VERSION__ >= 202311L
+static_assert(true); // Workaround for https://github.com/clangd/clangd/issues/1167
+#endif 
+
+#pragma clang diagnostic push
+
+// Set *very* aggressive diagnostics specific to clang (version 19.1.3).
+// These diagnostics aren't stable between compiler versions.
+// If used like this they're **EXPECTED** to break break the build,
+// but they're also useful for catching errors.
+// Use `make debug` to build with these diagnostics.
+#ifdef RACONIC
+#pragma clang diagnostic error   "-Weverything"
+#pragma clang diagnostic ignored "-Wunsafe-buffer-usage"
+#pragma clang diagnostic ignored "-Wdeclaration-after-statement"
+#pragma clang diagnostic ignored "-Wpre-c11-compat"
+#pragma clang diagnostic ignored "-Wpre-c23-compat"
+#pragma clang diagnostic ignored "-Wc2y-extensions"
+#pragma clang diagnostic ignored "-Wc++98-compat"
+#pragma clang diagnostic ignored "-Wnullability-extension"
+#pragma clang diagnostic ignored "-Wvla"
+#pragma clang diagnostic ignored "-Wgnu-statement-expression"
+#pragma clang diagnostic ignored "-Wgnu-conditional-omitted-operand"
+#pragma clang diagnostic ignored "-Wgnu-case-range"
+#pragma clang diagnostic ignored "-Wgnu-designator"
+#endif
+
+// Offsets of the header fields.
+#define HEADER_MAGIC       0
+#define HEADER_VERSION     8
+#define HEADER_SIZE        12
+#define HEADER_COUNT       16
+#define HEADER_ADDRS       24
+#define HEADER_OFFSETS     32
+#define HEADER_NAMES       40
+#define HEADER_NAMES_SIZE  48
+
+// Recognise a binary snapshot by its magic and check its header against the mapped size.
+// Anything else (e.g. a text ethers file) isn't a snapshot.
+struct snapshot
+snapshot_map(const struct valid map, const char path[const static 1])
+{
+	static const char magic[] = SNAPSHOT_MAGIC;
+	const size_t      size    = valid_length(map);
+	if (size < sizeof(magic) - 1 || memcmp(map.start, magic, sizeof(magic) - 1) != 0) {
+		return SNAPSHOT_NONE;
+	} else if (size < SNAPSHOT_HEADER_SIZE) {
+		xo_errx(EX_DATAERR, "The binary snapshot '%s' is truncated.", path);
+	}
+
+	const uint8_t *_Nonnull const base        = (const uint8_t *)map.start;
+	const uint32_t                version     = le32dec(&base[HEADER_VERSION]);
+	const uint32_t                header_size = le32dec(&base[HEADER_SIZE]);
+	const uint64_t                count       = le64dec(&base[HEADER_COUNT]);
+	const uint64_t                addrs       = le64dec(&base[HEADER_ADDRS]);
+	const uint64_t                offsets     = le64dec(&base[HEADER_OFFSETS]);
+	const uint64_t                names       = le64dec(&base[HEADER_NAMES]);
+	const uint64_t                names_size  = le64dec(&base[HEADER_NAMES_SIZE]);
+	if (version != SNAPSHOT_VERSION) {
+		xo_errx(EX_DATAERR, "Unsupported version %" PRIu32 " of binary snapshot '%s'.", version, path);
+	} else if (header_size < SNAPSHOT_HEADER_SIZE || header_size > size
+	        || addrs   > size || count >  (size - addrs  ) / ETHER_ADDR_LEN
+	        || offsets > size || count >= (size - offsets) / sizeof(uint32_t)
+	        || names   > size || names_size > size - names) {
+		xo_errx(EX_DATAERR, "The header of binary snapshot '%s' is corrupt.", path);
+	}
+
+	return (struct snapshot) {
+		.addrs      = &base[addrs],
+		.offsets    = &base[offsets],
+		.names      = &map.start[names],
+		.count      = count,
+		.names_size = names_size
+	};
+}
+
+// Copy out the MAC address and slice the hostname (without its NUL terminator) of an entry.
+// Returns -1 on an invalid name (reported by the reader), 0 after the last entry and ETHERS_ENTRY on success.
+ssize_t
+snapshot_read(const struct snapshot snapshot[const static 1], const size_t index,
+              struct ether_addr addr[const static 1], struct valid name[const static 1])
+{
+	if (index >= snapshot->count) {
+		return 0;
+	}
+
+	const uint32_t first = le32dec(&snapshot->offsets[sizeof(uint32_t) * index]);
+	const uint32_t next  = le32dec(&snapshot->offsets[sizeof(uint32_t) * (index + 1)]);
+	if (first >= next || next > snapshot->names_size || next - first > MAXHOSTNAMELEN || snapshot->names[next - 1] != '\0') {
+		return -1;
+	}
+	memcpy(addr->octet, &snapshot->addrs[ETHER_ADDR_LEN * index], ETHER_ADDR_LEN);
+	*name = VALID(&snapshot->names[first], &snapshot->names[next - 1]);
+	return ETHERS_ENTRY;
+}
+
+// Write the live mappings of all files sorted by MAC address to a binary snapshot.
+// The records are read once into the arena, keeping their hostnames in the mapped files,
+// and streamed out section by section. The snapshot replaces the old one only once
+// it's complete so readers mapping it never see a partial snapshot.
+void
+snapshot_export(const struct ethers_files *_Nonnull const files, const char path[const static 1])
+{
+	struct arena   arena   __attribute__((cleanup(arena_cleanup))) = ARENA_INIT;
+	struct records records = RECORDS_INIT(&arena);
+	for (size_t i = 0; i < files->count; i++) {
+		struct ethers_reader reader = ethers_reader_create(&files->file[i]);
+		read_records(&records, &reader);
+	}
+	const struct record *_Nullable const record = records.record;
+	const size_t                         live   = live_records(&records, false);
+
+	uint64_t names_size = 0;
+	for (size_t i = 0; i < live; i++) {
+		names_size += valid_length(record[i].name) + 1;
+	}
+	if (names_size > UINT32_MAX) {
+		xo_errx(EX_DATAERR, "The hostnames of %zu entries don't fit into a binary snapshot.", live);
+	}
+	const uint64_t addrs   = SNAPSHOT_HEADER_SIZE;
+	const uint64_t offsets = roundup2(addrs + (uint64_t)ETHER_ADDR_LEN * live, sizeof(uint64_t));
+	const uint64_t names   = offsets + sizeof(uint32_t) * ((uint64_t)live + 1);
+
+	uint8_t header[SNAPSHOT_HEADER_SIZE] = { 0 };
+	memcpy(&header[HEADER_MAGIC], SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC) - 1);
+	le32enc(&header[HEADER_VERSION]   , SNAPSHOT_VERSION);
+	le32enc(&header[HEADER_SIZE]      , SNAPSHOT_HEADER_SIZE);
+	le64enc(&header[HEADER_COUNT]     , live);
+	le64enc(&header[HEADER_ADDRS]     , addrs);
+	le64enc(&header[HEADER_OFFSETS]   , offsets);
+	le64enc(&header[HEADER_NAMES]     , names);
+	le64enc(&header[HEADER_NAMES_SIZE], names_size);
+
+	struct ethers_replace replace = ethers_replace_open(path, "binary snapshot", 0644);
+	FILE *_Nonnull const  stream  = replace.stream;
+
+	static const uint8_t padding[sizeof(uint64_t)] = { 0 };
+	const size_t         padded = (size_t)(offsets - addrs) - ETHER_ADDR_LEN * live;
+	bool failed = fwrite(header, sizeof(header), 1, stream) != 1;
+	for (size_t i = 0; !failed && i < live; i++) {
+		failed = fwrite(record[i].addr.octet, ETHER_ADDR_LEN, 1, stream) != 1;
+	}
+	failed = failed || fwrite(padding, sizeof(uint8_t), padded, stream) != padded;
+	uint32_t offset = 0;
+	for (size_t i = 0; !failed && i <= live; i++) {
+		uint8_t encoded[sizeof(uint32_t)];
+		le32enc(encoded, offset);
+		failed = fwrite(encoded, sizeof(encoded), 1, stream) != 1;
+		offset += i < live ? (uint32_t)valid_length(record[i].name) + 1 : 0;
+	}
+	for (size_t i = 0; !failed && i < live; i++) {
+		const size_t length = valid_length(record[i].name);
+		failed = fwrite(record[i].name.start, sizeof(char), length, stream) != length || fputc('\0', stream) == EOF;
+	}
+	ethers_replace_commit(&replace, failed);
+
+	if (xo_emit("{Lc:Exported}{P: }{:entries/%zu}{L: entries to }{:snapshot/%s}\n", live, path) < 0) {
+		xo_err(EX_IOERR, "Failed to emit export summary");
+	}
+}
+
+#pragma clang diagnostic pop
@@ -0,0 +1,86 @@
+// vim: ft=c:ts=8 :
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <sys/param.h>
+#include <net/ethernet.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "slice.h"
+
+#if __STDC_VERSION__ >= 202311L
+static_assert(true); // Workaround for https://github.com/clangd/clangd/issues/1167
+#endif 
+
+#pragma clang diagnostic push
+
+// Set *very* aggressive diagnostics specific to clang (version 19.1.3).
+// These diagnostics aren't stable between compiler versions.
+// If used like this they're **EXPECTED** to break break the build,
+// but they're also useful for catching errors.
+// Use `make debug` to build with these diagnostics.
+#ifdef RACONIC
+#pragma clang diagnostic error   "-Weverything"
+#pragma clang diagnostic ignored "-Wunsafe-buffer-usage"
+#pragma clang diagnostic ignored "-Wdeclaration-after-statement"
+#pragma clang diagnostic ignored "-Wpre-c11-compat"
+#pragma clang diagnostic ignored "-Wpre-c23-compat"
+#pragma clang diagnostic ignored "-Wc2y-extensions"
+#pragma clang diagnostic ignored "-Wc++98-compat"
+#pragma clang diagnostic ignored "-Wnullability-extension"
+#pragma clang diagnostic ignored "-Wvla"
+#pragma clang diagnostic ignored "-Wgnu-statement-expression"
+#pragma clang diagnostic ignored "-Wgnu-conditional-omitted-operand"
+#pragma clang diagnostic ignored "-Wgnu-case-range"
+#pragma clang diagnostic ignored "-Wgnu-designator"
+#endif
+
+// A binary snapshot holds the live mappings of one or more ethers files
+// in a layout that can be mapped and searched without parsing.
+// All integers are little endian and all offsets are relative to the start of the file:
+//
+//     offset  size            field
+//     0       8               magic "ETHERSNP"
+//     8       4               format version (SNAPSHOT_VERSION)
+//     12      4               header size (at least SNAPSHOT_HEADER_SIZE)
+//     16      8               number of entries <count>
+//     24      8               offset of the MAC addresses
+//     32      8               offset of the name offsets
+//     40      8               offset of the names
+//     48      8               size of the names
+//
+// The MAC addresses are <count> packed 6 byte addresses in ascending order (duplicates are kept in name order).
+// The name offsets are <count + 1> 4 byte offsets into the names: the name of entry i
+// is the NUL terminated string between offsets i and i + 1.
+#define SNAPSHOT_MAGIC       "ETHERSNP"
+#define SNAPSHOT_VERSION     1
+#define SNAPSHOT_HEADER_SIZE 56
+
+struct snapshot {
+	const uint8_t *_Nullable addrs;
+	const uint8_t *_Nullable offsets;
+	const char    *_Nullable names;
+	uint64_t                 count;
+	uint64_t                 names_size;
+};
+
+#define SNAPSHOT_NONE ((struct snapshot) { .addrs = NULL, .offsets = NULL, .names = NULL, .count = 0, .names_size = 0 })
+
+struct ethers_files;
+
+static inline bool
+is_snapshot(const struct snapshot snapshot[const static 1])
+{
+	return snapshot->addrs != NULL;
+}
+
+struct snapshot snapshot_map(struct valid map, const char path[const static 1]);
+ssize_t         snapshot_read(const struct snapshot snapshot[const static 1], size_t index,
+                              struct ether_addr addr[const static 1], struct valid name[const static 1]);
+void            snapshot_export(const struct ethers_files *_Nonnull files, const char path[const static 1]);
+
+#pragma clang diagnostic pop
+#endif /* SNAPSHOT_H */
@@ -0,0 +1,459 @@
+// vim: ft=c:ts=8 :
+
+// Load generator spawning concurrent ethers(1) clients allocating against a shared temporary ethers(5) file.
+// Reports the allocation throughput, the latency and lock wait percentiles
+// and fails if any address or hostname was assigned twice.
+// With -d all clients request the same hostnames racing to allocate each of them first,
+// which only the exclusive lock catches (-S appends under the shared lock and reports the duplicates).
+
+// Include library headers
+#include <libxo/xo.h>
+
+// Include system headers from subdirectories.
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+// Include system headers
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <paths.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#if __STDC_VERSION__ >= 202311L
+static_assert(true); // Workaround for https://github.com/clangd/clangd/issues/1167
+#endif 
+
+#pragma clang diagnostic push
+
+// Set *very* aggressive diagnostics specific to clang (version 19.1.3).
+// These diagnostics aren't stable between compiler versions.
+// If used like this they're **EXPECTED** to break break the build,
+// but they're also useful for catching errors.
+// Use `make debug` to build with these diagnostics.
+#ifdef RACONIC
+#pragma clang diagnostic error   "-Weverything"
+#pragma clang diagnostic ignored "-Wunsafe-buffer-usage"
+#pragma clang diagnostic ignored "-Wdeclaration-after-statement"
+#pragma clang diagnostic ignored "-Wpre-c11-compat"
+#pragma clang diagnostic ignored "-Wpre-c23-compat"
+#pragma clang diagnostic ignored "-Wc2y-extensions"
+#pragma clang diagnostic ignored "-Wc++98-compat"
+#pragma clang diagnostic ignored "-Wnullability-extension"
+#pragma clang diagnostic ignored "-Wvla"
+#pragma clang diagnostic ignored "-Wgnu-statement-expression"
+#pragma clang diagnostic ignored "-Wgnu-conditional-omitted-operand"
+#pragma clang diagnostic ignored "-Wgnu-case-range"
+#pragma clang diagnostic ignored "-Wgnu-designator"
+#endif
+
+// Define string constants as macros (constexpr is a C23 feature).
+#define PROG_NAME    "ethers-stress"
+#define LOCK_WAIT    "\"lock-wait-ns\""
+
+// Retries back off exponentially from BACKOFF_MIN_NS up to BACKOFF_MAX_NS (with full jitter).
+#define BACKOFF_MIN_NS UINT64_C(50000)
+#define BACKOFF_MAX_NS UINT64_C(5000000)
+
+extern char **environ;
+
+// One allocation as seen by a client including the attempts that had to be retried.
+struct sample {
+	uint64_t latency;
+	uint64_t lock_wait;
+	uint64_t retries;
+};
+
+struct options {
+	const char *_Nonnull ethers;
+	unsigned             clients;
+	unsigned             allocations;
+	bool                 keep;
+	bool                 shared;
+	bool                 duplicate;
+};
+
+static void __attribute__((noreturn))
+usage(void)
+{
+	xo_errx(EX_USAGE, "usage: %s [-d] [-k] [-S] [-c clients] [-n allocations] [-p ethers]", PROG_NAME);
+}
+
+static unsigned
+parse_count(const char arg[const static 1])
+{
+	char *_Nullable end = NULL;
+	errno = 0;
+	const unsigned long value = strtoul(arg, &end, 10);
+	if (errno != 0 || end == arg || *end != '\0' || value == 0 || value > 65536) {
+		xo_errx(EX_USAGE, "Invalid count: %s", arg);
+	}
+	return (unsigned)value;
+}
+
+static struct options
+parse_options(int argc, char *_Nonnull argv[const])
+{
+	struct options options = { .ethers = "./ethers", .clients = 8, .allocations = 64, .keep = false, .shared = false, .duplicate = false };
+	int            ch;
+	while ((ch = getopt(argc, argv, "dkSc:n:p:")) != -1) {
+		switch (ch) {
+		case 'd':
+			options.duplicate = true;
+			break;
+		case 'k':
+			options.keep = true;
+			break;
+		case 'S':
+			options.shared = true;
+			break;
+		case 'c':
+			options.clients = parse_count(optarg);
+			break;
+		case 'n':
+			options.allocations = parse_count(optarg);
+			break;
+		case 'p':
+			options.ethers = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc) {
+		usage();
+	}
+	return options;
+}
+
+static uint64_t
+now(void)
+{
+	struct timespec time;
+	if (clock_gettime(CLOCK_MONOTONIC, &time) != 0) {
+		xo_err(EX_OSERR, "Failed to read the monotonic clock");
+	}
+	return (uint64_t)time.tv_sec * UINT64_C(1000000000) + (uint64_t)time.tv_nsec;
+}
+
+// Run a single ethers(1) invocation with structured output returning its exit status
+// and the lock wait time it reported.
+static int
+invoke(const struct options options[const static 1], const char path[const static 1], const char name[const static 1], uint64_t lock_wait[const static 1])
+{
+	int                        pipe_fds[2];
+	posix_spawn_file_actions_t actions;
+	pid_t                      pid;
+	char                       output[4096];
+	size_t                     length = 0;
+	int                        status;
+
+	if (pipe(pipe_fds) != 0) {
+		xo_err(EX_OSERR, "Failed to create pipe");
+	} else if (posix_spawn_file_actions_init(&actions) != 0 ||
+	           posix_spawn_file_actions_adddup2(&actions, pipe_fds[1], STDOUT_FILENO) != 0 ||
+	           posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, _PATH_DEVNULL, O_WRONLY, 0) != 0 ||
+	           posix_spawn_file_actions_addclose(&actions, pipe_fds[0]) != 0) {
+		xo_errx(EX_OSERR, "Failed to prepare spawn file actions");
+	}
+
+	// The warnings silenced by -q in place of -S are discarded anyway.
+	char *const argv[] = { (char *)(uintptr_t)options->ethers, "--libxo", "json", options->shared ? "-S" : "-q", "-f", (char *)(uintptr_t)path, (char *)(uintptr_t)name, NULL };
+	const int   error  = posix_spawn(&pid, options->ethers, &actions, NULL, argv, environ);
+	if (error != 0) {
+		errno = error;
+		xo_err(EX_OSERR, "Failed to spawn '%s'", options->ethers);
+	}
+	posix_spawn_file_actions_destroy(&actions);
+	close(pipe_fds[1]);
+
+	// Keep draining after the buffer is full to never block the client.
+	for (;;) {
+		char          discard[4096];
+		char *const   target = length < sizeof(output) - 1 ? output + length : discard;
+		const size_t  space  = length < sizeof(output) - 1 ? sizeof(output) - 1 - length : sizeof(discard);
+		const ssize_t bytes  = read(pipe_fds[0], target, space);
+		if (bytes < 0 && errno == EINTR) {
+			continue;
+		} else if (bytes < 0) {
+			xo_err(EX_IOERR, "Failed to read client output");
+		} else if (bytes == 0) {
+			break;
+		} else if (target == output + length) {
+			length += (size_t)bytes;
+		}
+	}
+	output[length] = '\0';
+	close(pipe_fds[0]);
+
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			xo_err(EX_OSERR, "Failed to wait for client");
+		}
+	}
+
+	const char *_Nullable const field = strstr(output, LOCK_WAIT);
+	*lock_wait = field == NULL ? 0 : strtoull(field + sizeof(LOCK_WAIT) - 1 + strspn(field + sizeof(LOCK_WAIT) - 1, ": "), NULL, 10);
+	return WIFEXITED(status) ? WEXITSTATUS(status) : EX_SOFTWARE;
+}
+
+// Sleep a random time up to the exponentially growing backoff before the next retry
+// to keep retrying clients from colliding with each other again right away.
+static void
+backoff(const uint64_t retries)
+{
+	const uint64_t limit = retries >= 7 ? BACKOFF_MAX_NS : MIN(BACKOFF_MIN_NS << retries, BACKOFF_MAX_NS);
+	const uint64_t delay = ((uint64_t)arc4random() << 32 | arc4random()) % limit;
+	struct timespec remaining = { .tv_sec = (time_t)(delay / UINT64_C(1000000000)), .tv_nsec = (long)(delay % UINT64_C(1000000000)) };
+	while (nanosleep(&remaining, &remaining) != 0) {
+		if (errno != EINTR) {
+			xo_err(EX_OSERR, "Failed to sleep before retrying");
+		}
+	}
+}
+
+// Allocate the hostnames of one client in sequence retrying concurrently modified files.
+static void __attribute__((noreturn))
+run_client(const struct options options[const static 1], const char path[const static 1], const unsigned client, struct sample samples[const])
+{
+	for (unsigned i = 0; i < options->allocations; i++) {
+		struct sample *_Nonnull const sample = &samples[i];
+		char                          name[MAXHOSTNAMELEN];
+		const uint64_t                start  = now();
+		int                           status;
+
+		if (options->duplicate) {
+			snprintf(name, sizeof(name), "stress-%u", i);
+		} else {
+			snprintf(name, sizeof(name), "stress-%u-%u", client, i);
+		}
+		*sample = (struct sample) { .latency = 0, .lock_wait = 0, .retries = 0 };
+		for (;;) {
+			uint64_t lock_wait = 0;
+			status = invoke(options, path, name, &lock_wait);
+			sample->lock_wait += lock_wait;
+			if (status != EX_TEMPFAIL) {
+				break;
+			}
+			backoff(sample->retries++);
+		}
+		if (status != EX_OK) {
+			xo_errx(EX_SOFTWARE, "Client %u failed to allocate '%s' (exit status %d).", client, name, status);
+		}
+		sample->latency = now() - start;
+	}
+	_exit(EX_OK);
+}
+
+static int
+compare_u64(const void *_Nonnull const a, const void *_Nonnull const b)
+{
+	const uint64_t x = *(const uint64_t *)a;
+	const uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static int
+compare_strings(const void *_Nonnull const a, const void *_Nonnull const b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static uint64_t
+percentile(const uint64_t sorted[const], const size_t count, const unsigned percent)
+{
+	return count == 0 ? 0 : sorted[(count - 1) * percent / 100];
+}
+
+// Count the values occurring more than once after sorting them.
+static size_t
+count_duplicates(char *_Nonnull values[const], const size_t count)
+{
+	size_t duplicates = 0;
+	qsort(values, count, sizeof(char *), compare_strings);
+	for (size_t i = 1; i < count; i++) {
+		if (strcmp(values[i - 1], values[i]) == 0) {
+			xo_warnx("Assigned twice: %s", values[i]);
+			duplicates++;
+		}
+	}
+	return duplicates;
+}
+
+// Check the resulting file contains every requested hostname exactly once with a unique address.
+// Each invocation appends at most one line, clients sharing hostnames must append fewer.
+static bool
+verify_file(const struct options options[const static 1], const char path[const static 1])
+{
+	const size_t     capacity = (size_t)options->clients * options->allocations;
+	const size_t     expected = options->duplicate ? options->allocations : capacity;
+	char *_Nullable *addrs    = calloc(capacity + 1, sizeof(char *));
+	char *_Nullable *names    = calloc(capacity + 1, sizeof(char *));
+	FILE *_Nullable  file     = fopen(path, "r");
+	size_t           count    = 0;
+	char             line[MAXHOSTNAMELEN + 64];
+	if (addrs == NULL || names == NULL) {
+		xo_err(EX_OSERR, "Failed to allocate %zu entries", capacity);
+	} else if (file == NULL) {
+		xo_err(EX_NOINPUT, "Failed to open '%s'", path);
+	}
+
+	while (fgets(line, sizeof(line), file) != NULL) {
+		char addr[sizeof("xx:xx:xx:xx:xx:xx")];
+		char name[MAXHOSTNAMELEN];
+		if (line[0] == '#' || sscanf(line, "%17s %255s", addr, name) != 2) {
+			continue;
+		} else if (count == capacity) {
+			xo_warnx("More entries than allocations in '%s'", path);
+			count++;
+			break;
+		} else if ((addrs[count] = strdup(addr)) == NULL || (names[count] = strdup(name)) == NULL) {
+			xo_err(EX_OSERR, "Failed to copy entry");
+		}
+		count++;
+	}
+	fclose(file);
+
+	const size_t stored     = MIN(count, capacity);
+	const size_t duplicates = count_duplicates(addrs, stored) + count_duplicates(names, stored);
+	if (count != expected) {
+		xo_warnx("Expected %zu entries but found %zu.", expected, count);
+	}
+	for (size_t i = 0; i < stored; i++) {
+		free(addrs[i]);
+		free(names[i]);
+	}
+	free(addrs);
+	free(names);
+
+	if (xo_emit("{L:Entries}{D: = }{:entries/%zu}{D:, }{L:Duplicates}{D: = }{:duplicates/%zu}\n", count, duplicates) < 0) {
+		xo_err(EX_IOERR, "Failed to emit verification");
+	}
+	return count == expected && duplicates == 0;
+}
+
+static void
+report(const struct options options[const static 1], struct sample samples[const], const uint64_t elapsed)
+{
+	const size_t count     = (size_t)options->clients * options->allocations;
+	uint64_t    *latencies = calloc(count, sizeof(uint64_t));
+	uint64_t    *waits     = calloc(count, sizeof(uint64_t));
+	uint64_t    *tries     = calloc(count, sizeof(uint64_t));
+	uint64_t     retries   = 0;
+	uint64_t     waited    = 0;
+	if (latencies == NULL || waits == NULL || tries == NULL) {
+		xo_err(EX_OSERR, "Failed to allocate %zu samples", count);
+	}
+	for (size_t i = 0; i < count; i++) {
+		latencies[i] = samples[i].latency;
+		waits[i]     = samples[i].lock_wait;
+		tries[i]     = samples[i].retries;
+		retries     += samples[i].retries;
+		waited      += samples[i].lock_wait;
+	}
+	qsort(latencies, count, sizeof(uint64_t), compare_u64);
+	qsort(waits, count, sizeof(uint64_t), compare_u64);
+	qsort(tries, count, sizeof(uint64_t), compare_u64);
+
+	const double seconds = (double)elapsed / 1e9;
+	if (xo_emit("{L:Clients}{D: = }{:clients/%u}{D:, }{L:Allocations}{D: = }{:allocations/%zu}\n"
+	            "{L:Elapsed}{D: = }{:elapsed/%.3f}{U:s}{D:, }{L:Throughput}{D: = }{:throughput/%.1f}{D: }{U:allocations per second}\n"
+	            "{L:Latency}{D: = }{L:p50}{D: }{:latency-p50-us/%.1f}{U:us}{D:, }{L:p99}{D: }{:latency-p99-us/%.1f}{U:us}\n"
+	            "{L:Lock wait}{D: = }{L:p50}{D: }{:lock-wait-p50-us/%.1f}{U:us}{D:, }{L:p99}{D: }{:lock-wait-p99-us/%.1f}{U:us}{D:, }"
+	            "{L:total}{D: }{:lock-wait-total-ms/%.1f}{U:ms}\n"
+	            "{L:Retries}{D: = }{L:p50}{D: }{:retries-p50/%" PRIu64 "}{D:, }{L:p99}{D: }{:retries-p99/%" PRIu64 "}{D:, }"
+	            "{L:total}{D: }{:retries/%" PRIu64 "}\n",
+	            options->clients, count, seconds, seconds > 0 ? (double)count / seconds : 0.0,
+	            (double)percentile(latencies, count, 50) / 1e3, (double)percentile(latencies, count, 99) / 1e3,
+	            (double)percentile(waits, count, 50) / 1e3, (double)percentile(waits, count, 99) / 1e3, (double)waited / 1e6,
+	            percentile(tries, count, 50), percentile(tries, count, 99), retries) < 0) {
+		xo_err(EX_IOERR, "Failed to emit report");
+	}
+	free(latencies);
+	free(waits);
+	free(tries);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const char prog_name[] = PROG_NAME;
+	setprogname(prog_name);
+	atexit(xo_finish_atexit);
+
+	argc = xo_parse_args(argc, argv);
+
+	xo_set_program(prog_name);
+	xo_open_container(prog_name);
+
+	const struct options options = parse_options(argc, argv);
+	const size_t         count   = (size_t)options.clients * options.allocations;
+
+	// The clients write their samples into shared anonymous memory.
+	struct sample *const samples = mmap(NULL, count * sizeof(struct sample), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+	if (samples == MAP_FAILED) {
+		xo_err(EX_OSERR, "Failed to map %zu samples", count);
+	}
+
+	char path[] = _PATH_TMP "ethers-stress.XXXXXX";
+	const int fd = mkstemp(path);
+	if (fd < 0) {
+		xo_err(EX_CANTCREAT, "Failed to create temporary ethers file");
+	}
+	close(fd);
+
+	// The shared bitmap is created next to the ethers file by the first client.
+	char bitmap[sizeof(path) + sizeof("..bitmap")];
+	snprintf(bitmap, sizeof(bitmap), _PATH_TMP ".%s.bitmap", &path[sizeof(_PATH_TMP) - 1]);
+
+	const uint64_t start = now();
+	pid_t          pids[options.clients];
+	for (unsigned client = 0; client < options.clients; client++) {
+		pids[client] = fork();
+		if (pids[client] < 0) {
+			xo_err(EX_OSERR, "Failed to fork client %u", client);
+		} else if (pids[client] == 0) {
+			run_client(&options, path, client, &samples[(size_t)client * options.allocations]);
+		}
+	}
+
+	bool failed = false;
+	for (unsigned client = 0; client < options.clients; client++) {
+		int status;
+		while (waitpid(pids[client], &status, 0) < 0) {
+			if (errno != EINTR) {
+				xo_err(EX_OSERR, "Failed to wait for client %u", client);
+			}
+		}
+		failed |= !WIFEXITED(status) || WEXITSTATUS(status) != EX_OK;
+	}
+	const uint64_t elapsed = now() - start;
+
+	if (failed) {
+		xo_errx(EX_SOFTWARE, "Some clients failed, leaving '%s' in place.", path);
+	}
+
+	report(&options, samples, elapsed);
+	const bool unique = verify_file(&options, path);
+	if (!options.keep && unique && unlink(path) != 0) {
+		xo_err(EX_IOERR, "Failed to remove '%s'", path);
+	} else if (!options.keep && unique && options.shared && unlink(bitmap) != 0) {
+		xo_err(EX_IOERR, "Failed to remove '%s'", bitmap);
+	} else if (!unique) {
+		xo_errx(EX_SOFTWARE, "Addresses or hostnames were assigned twice, leaving '%s' in place.", path);
+	}
+
+	xo_close_container(prog_name);
+	return EX_OK;
+}
+
+#pragma clang diagnostic pop